@@ -0,0 +1,270 @@
+// Benchmarks of the real picp flows, against an emulated programmer over a simulated link.
+//
+// Results are printed as a table, and written as JSON to the file given as the first argument.
+
+#define PICP_MOCK_PORT
+#define main picp_main
+#include "picp.cpp"
+#undef main
+#include "libpicp.cpp"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::string ihex_record(unsigned int address, uint8_t type, std::vector<uint8_t> const & data) {
+	uint8_t checksum = data.size() + (address >> 8) + address + type;
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), ":%02X%04X%02X", unsigned(data.size()), address & 0xFFFF, type);
+	std::string r = buffer;
+	for (uint8_t b : data) {
+		snprintf(buffer, sizeof(buffer), "%02X", b);
+		r += buffer;
+		checksum += b;
+	}
+	snprintf(buffer, sizeof(buffer), "%02X\n", uint8_t(0x100 - checksum));
+	return r + buffer;
+}
+
+// Words for make_image() that are left out of the image.
+uint16_t const not_given = 0xFFFF;
+
+// The words of program memory for an image with the given words filled with (pseudo random) data.
+// Words for which `changed` is true get different data.
+std::vector<uint16_t> image_words(std::function<bool (unsigned int)> used, std::function<bool (unsigned int)> changed = [] (unsigned int) { return false; }) {
+	std::vector<uint16_t> words(0x2000, not_given);
+	for (unsigned int i = 0; i < 0x2000; ++i) {
+		if (!used(i)) continue;
+		uint32_t x = (i + (changed(i) ? 0x10000 : 0)) * 2654435761u;
+		words[i] = (x >> 12) & 0x3FFF;
+	}
+	return words;
+}
+
+// An Intel HEX image with the given words of program memory, and the configuration words set.
+// Only blocks of 8 words that are all given are included.
+std::string make_image(std::vector<uint16_t> const & words) {
+	std::string hex;
+	for (unsigned int a = 0; a + 8 <= words.size(); a += 8) {
+		std::vector<uint8_t> data;
+		for (unsigned int i = a; i < a + 8; ++i) {
+			if (words[i] == not_given) break;
+			data.push_back(words[i] & 0xFF);
+			data.push_back(words[i] >> 8);
+		}
+		if (data.size() == 16) hex += ihex_record(a * 2, 0x00, data);
+	}
+	hex += ihex_record(0, 0x04, {0x00, 0x01});
+	hex += ihex_record(0x0E, 0x00, {0x84, 0x3F, 0xFF, 0x1F});
+	hex += ihex_record(0, 0x01, {});
+	return hex;
+}
+
+std::string make_image(std::function<bool (unsigned int)> used, std::function<bool (unsigned int)> changed = [] (unsigned int) { return false; }) {
+	return make_image(image_words(used, changed));
+}
+
+struct Result {
+	std::string flow;
+	std::string image;
+	size_t words;
+	bool ok;
+	double seconds;
+	size_t bytes_written;
+	size_t bytes_read;
+	size_t round_trips;
+};
+
+// Input that arrives in two parts, with a pause in between, like from a slow pipe.
+struct PausedInput : std::streambuf {
+	std::string data;
+	PausedInput(std::string const & data, size_t pause_at) : data(data) {
+		setg(&this->data[0], &this->data[0], &this->data[0] + pause_at);
+	}
+	int underflow() override {
+		if (gptr() == &data[0] + data.size()) return traits_type::eof();
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		setg(&data[0], gptr(), &data[0] + data.size());
+		return traits_type::to_int_type(*gptr());
+	}
+};
+
+// Run picp with the given command and stdin, with its output thrown away.
+// The result is ok if picp succeeds, or, if `should_fail` is set, if it fails.
+Result run(std::vector<std::string> const & command, std::string const & image_name, std::streambuf & input, size_t words, bool should_fail = false) {
+	auto old_cin = std::cin.rdbuf(&input);
+	fflush(stdout);
+	fflush(stderr);
+	int old_stdout = dup(1);
+	int old_stderr = dup(2);
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, 1);
+	dup2(null, 2);
+	close(null);
+
+	MockLink before = mock_link;
+	std::vector<std::string> args = command;
+	args.insert(args.begin(), "picp");
+	std::vector<char *> argv;
+	for (auto & a : args) argv.push_back(&a[0]);
+	argv.push_back(0);
+	auto start = Clock::now();
+	int status = picp_main(args.size(), argv.data());
+	auto end = Clock::now();
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(old_stdout, 1);
+	dup2(old_stderr, 2);
+	close(old_stdout);
+	close(old_stderr);
+	std::cin.rdbuf(old_cin);
+
+	Result r;
+	for (auto & c : command) r.flow += (r.flow.empty() ? "" : " ") + c;
+	r.image = image_name;
+	r.words = words;
+	r.ok = (status == 0) != should_fail;
+	r.seconds = std::chrono::duration<double>(end - start).count();
+	r.bytes_written = mock_link.bytes_written - before.bytes_written;
+	r.bytes_read = mock_link.bytes_read - before.bytes_read;
+	r.round_trips = mock_link.round_trips - before.round_trips;
+	return r;
+}
+
+Result run(std::vector<std::string> const & command, std::string const & image_name, std::string const & input, size_t words, bool should_fail = false) {
+	std::stringbuf in(input);
+	return run(command, image_name, in, words, should_fail);
+}
+
+}
+
+int main(int argc, char * * argv) try {
+
+	char const * output = "bench.json";
+
+	// Defaults: roughly a full speed USB link and the bit banging of the firmware.
+	mock_link.emulator.byte_time = std::chrono::nanoseconds(1000);
+	mock_link.emulator.icsp_time = std::chrono::nanoseconds(20000);
+
+	for (int i = 1; i < argc; ++i) {
+		char const * a = argv[i];
+		     if (!strncmp(a, "--latency=", 10)) mock_link.latency = std::chrono::microseconds(strtoul(a + 10, 0, 10));
+		else if (!strncmp(a, "--byte-time=", 12)) mock_link.emulator.byte_time = std::chrono::nanoseconds(strtoul(a + 12, 0, 10));
+		else if (!strncmp(a, "--icsp-time=", 12)) mock_link.emulator.icsp_time = std::chrono::nanoseconds(strtoul(a + 12, 0, 10));
+		else if (!strncmp(a, "--program-time=", 15)) mock_link.emulator.target.program_time = std::chrono::microseconds(strtoul(a + 15, 0, 10));
+		else if (!strncmp(a, "--erase-time=", 13)) mock_link.emulator.target.bulk_erase_time = std::chrono::microseconds(strtoul(a + 13, 0, 10));
+		else if (a[0] != '-') output = a;
+		else {
+			std::clog << "Usage: " << argv[0] << " [options] [output.json]\n";
+			std::clog << "Options: --latency=500 (us, one way) --byte-time=1000 (ns) --icsp-time=20000 (ns)\n";
+			std::clog << "         --program-time=2500 (us) --erase-time=5000 (us)\n";
+			return 1;
+		}
+	}
+
+	struct Image { char const * name; std::function<bool (unsigned int)> used; };
+	Image images[] = {
+		{ "empty", [] (unsigned int) { return false; } },
+		{ "sparse", [] (unsigned int a) { return a < 0x100 || (a >= 0x1F00 && a < 0x1F40); } },
+		{ "half", [] (unsigned int a) { return a < 0x1000; } },
+		{ "full", [] (unsigned int) { return true; } },
+	};
+
+	std::vector<Result> results;
+
+	for (auto & image : images) {
+		size_t words = 0;
+		for (unsigned int a = 0; a < 0x2000; a += 8) words += image.used(a) ? 8 : 0;
+		results.push_back(run({"program"}, image.name, make_image(image.used), words));
+	}
+	// Reflashing the full image, unchanged and with 4 of every 64 rows changed.
+	auto all = [] (unsigned int) { return true; };
+	results.push_back(run({"program", "--incremental"}, "same", make_image(all), 0x2000));
+	auto changed = make_image(all, [] (unsigned int a) { return a / 32 % 16 == 3; });
+	results.push_back(run({"program", "--incremental"}, "changed", changed, 0x2000));
+	results.push_back(run({"verify"}, "changed", changed, 0x2000));
+	results.push_back(run({"verify", "--fast"}, "changed", changed, 0x2000));
+	results.push_back(run({"dump"}, "", "", 0x2000 + 11));
+	results.push_back(run({"config"}, "", "", 11));
+	results.push_back(run({"erase"}, "", "", 0));
+
+	// Checks of cases that differ only in a way that must not go unnoticed.
+
+	// Checksums must tell an erased word (0x3FFF) apart from 0x0000.
+	std::vector<uint16_t> erased_word = image_words(all);
+	erased_word[5] = 0x3FFF;
+	std::vector<uint16_t> zero_word = erased_word;
+	zero_word[5] = 0x0000;
+	results.push_back(run({"program"}, "3fff", make_image(erased_word), 0x2000));
+	results.push_back(run({"verify", "--fast"}, "0000", make_image(zero_word), 0x2000, true));
+	// And so must program --incremental, which skips the rows with the same checksum.
+	results.push_back(run({"program", "--incremental"}, "0000", make_image(zero_word), 0x2000));
+	results.push_back(run({"verify"}, "0000", make_image(zero_word), 0x2000));
+
+	// Streaming to a device with 16 word rows, in order, and with the first record moved to the end.
+	EmulatedTarget & target = mock_link.emulator.target;
+	EmulatedTarget const original = target;
+	Device const & small = *find_device("PIC16F1507");
+	target.device_id = small.device_id;
+	target.program_size = small.program_size;
+	target.row_size = small.row_size;
+	auto first_half = [] (unsigned int a) { return a < 0x400; };
+	std::string stream = make_image(first_half);
+	results.push_back(run({"program", "--stream"}, "16", stream, 0x400));
+	results.push_back(run({"verify"}, "16", stream, 0x400));
+	std::string reordered = make_image(first_half, [] (unsigned int a) { return a < 8; });
+	size_t first_record = reordered.find('\n') + 1;
+	size_t last_data = reordered.find(":02000004");
+	reordered = reordered.substr(first_record, last_data - first_record) + reordered.substr(0, first_record) + reordered.substr(last_data);
+	// (The pause is longer than connecting and erasing take, so the rows before the moved record are
+	// written first, and need to be written again.)
+	PausedInput paused(reordered, last_data - first_record);
+	results.push_back(run({"program", "--stream"}, "16 back", paused, 0x400));
+	results.push_back(run({"verify"}, "16 back", reordered, 0x400));
+	target.device_id = original.device_id;
+	target.program_size = original.program_size;
+	target.row_size = original.row_size;
+
+	std::ofstream json(output);
+	json << "{\n";
+	json << "\t\"settings\": {";
+	json << "\"latency_us\": " << std::chrono::duration_cast<std::chrono::microseconds>(mock_link.latency).count();
+	json << ", \"byte_time_ns\": " << std::chrono::duration_cast<std::chrono::nanoseconds>(mock_link.emulator.byte_time).count();
+	json << ", \"icsp_time_ns\": " << std::chrono::duration_cast<std::chrono::nanoseconds>(mock_link.emulator.icsp_time).count();
+	json << ", \"program_time_us\": " << std::chrono::duration_cast<std::chrono::microseconds>(mock_link.emulator.target.program_time).count();
+	json << ", \"erase_time_us\": " << std::chrono::duration_cast<std::chrono::microseconds>(mock_link.emulator.target.bulk_erase_time).count();
+	json << "},\n";
+	json << "\t\"results\": [\n";
+	printf("%-22s %-7s %6s %4s %9s %9s %9s %7s %10s\n", "flow", "image", "words", "ok", "seconds", "written", "read", "trips", "words/s");
+	for (size_t i = 0; i < results.size(); ++i) {
+		Result const & r = results[i];
+		double words_per_second = r.seconds > 0 ? r.words / r.seconds : 0;
+		printf("%-22s %-7s %6zu %4s %9.3f %9zu %9zu %7zu %10.0f\n", r.flow.c_str(), r.image.c_str(), r.words, r.ok ? "yes" : "NO", r.seconds, r.bytes_written, r.bytes_read, r.round_trips, words_per_second);
+		json << "\t\t{\"flow\": \"" << r.flow << "\", \"image\": \"" << r.image << "\"";
+		json << ", \"words\": " << r.words << ", \"ok\": " << (r.ok ? "true" : "false");
+		json << ", \"seconds\": " << r.seconds;
+		json << ", \"bytes_written\": " << r.bytes_written << ", \"bytes_read\": " << r.bytes_read;
+		json << ", \"round_trips\": " << r.round_trips << ", \"words_per_second\": " << words_per_second << "}";
+		json << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	json << "\t],\n";
+	json << "\t\"timing_violations\": " << mock_link.emulator.target.timing_violations << "\n";
+	json << "}\n";
+	if (!json) throw std::runtime_error(std::string("Unable to write ") + output + ".");
+
+	bool ok = mock_link.emulator.target.timing_violations == 0;
+	for (auto & r : results) ok &= r.ok;
+	if (mock_link.emulator.target.timing_violations) printf("%zu timing violations.\n", mock_link.emulator.target.timing_violations);
+	return ok ? 0 : 1;
+
+} catch (std::exception & e) {
+	std::clog << e.what() << std::endl;
+	return 1;
+}
@@ -0,0 +1,54 @@
+// The chips that can be programmed, with their memory layout and timing.
+//
+// All of them use the same ICSP commands and the same low voltage programming entry sequence,
+// and have their user id at 0x8000, device id at 0x8006 and configuration words at 0x8007 and 0x8008.
+// Times are the (maximum) programming and erase times of their programming specification, in microseconds.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct Device {
+	char const * name;
+	uint16_t device_id;
+	uint16_t device_id_mask;     // Some chips have their revision in the lower bits of the device id.
+	size_t program_size;         // Words of program memory.
+	size_t row_size;             // Words per row, which is also the number of write latches.
+	size_t configuration_size;   // Words of configuration memory that can be read, starting at 0x8000.
+	unsigned int program_time;   // tPINT, program memory.
+	unsigned int configuration_program_time; // tPINT, configuration memory.
+	unsigned int bulk_erase_time; // tERAB
+	unsigned int row_erase_time; // tERAR
+};
+
+// PIC16(L)F145x: DS41620C. PIC16(L)F150x: DS41573C.
+Device const devices[] = {
+	{ "PIC16F1454",  0x3020, 0x3FFF, 0x2000, 32, 11, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1454", 0x3024, 0x3FFF, 0x2000, 32, 11, 2500, 5000, 5000, 2500 },
+	{ "PIC16F1455",  0x3021, 0x3FFF, 0x2000, 32, 11, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1455", 0x3025, 0x3FFF, 0x2000, 32, 11, 2500, 5000, 5000, 2500 },
+	{ "PIC16F1459",  0x3023, 0x3FFF, 0x2000, 32, 11, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1459", 0x3027, 0x3FFF, 0x2000, 32, 11, 2500, 5000, 5000, 2500 },
+	{ "PIC16F1503",  0x2CE0, 0x3FE0, 0x0800, 16,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1503", 0x2DA0, 0x3FE0, 0x0800, 16,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16F1507",  0x2D00, 0x3FE0, 0x0800, 16,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1507", 0x2DC0, 0x3FE0, 0x0800, 16,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16F1508",  0x2D20, 0x3FE0, 0x1000, 32,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1508", 0x2D60, 0x3FE0, 0x1000, 32,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16F1509",  0x2D40, 0x3FE0, 0x2000, 32,  9, 2500, 5000, 5000, 2500 },
+	{ "PIC16LF1509", 0x2D80, 0x3FE0, 0x2000, 32,  9, 2500, 5000, 5000, 2500 },
+};
+
+inline Device const * find_device(uint16_t device_id) {
+	for (auto & d : devices) {
+		if ((device_id & d.device_id_mask) == d.device_id) return &d;
+	}
+	return 0;
+}
+
+inline Device const * find_device(char const * name) {
+	for (auto & d : devices) {
+		if (!strcmp(name, d.name)) return &d;
+	}
+	return 0;
+}
@@ -0,0 +1,351 @@
+// Software model of the programmer (the firmware in pic/) with a PIC16F145x attached to it.
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+typedef std::chrono::steady_clock Clock;
+
+// A PIC16F145x, as seen through its ICSP interface.
+struct EmulatedTarget {
+
+	uint16_t device_id = 0x3020; // PIC16F1454
+	uint16_t revision_id = 0x2003;
+	bool present = true;
+
+	size_t program_size = 0x2000; // Words. At most 0x2000.
+	size_t row_size = 32; // Number of latches. A power of two, at most 32.
+
+	// Timing, as given in the programming specification.
+	Clock::duration program_time = std::chrono::microseconds(2500);        // tPINT, program memory
+	Clock::duration configuration_program_time = std::chrono::microseconds(5000); // tPINT, configuration memory
+	Clock::duration external_program_time = std::chrono::microseconds(1000); // tPEXT (minimum)
+	Clock::duration discharge_time = std::chrono::microseconds(300);       // tDIS
+	Clock::duration bulk_erase_time = std::chrono::microseconds(5000);     // tERAB
+	Clock::duration row_erase_time = std::chrono::microseconds(2500);      // tERAR
+
+	uint16_t program[0x2000];
+	uint16_t configuration[0x0B]; // 0x8000 - 0x800A
+
+	// Number of commands that were given while the target was still busy programming or erasing.
+	// Those commands are ignored, just like a real chip would (probably) do.
+	size_t timing_violations = 0;
+
+private:
+	bool programming_mode = false;
+	uint16_t address = 0; // Bit 15 selects configuration memory.
+	uint16_t latches[32];
+	Clock::time_point busy_until;
+	Clock::time_point external_start;
+
+	bool in_configuration() const { return address & 0x8000; }
+
+	void clear_latches() {
+		std::fill(std::begin(latches), std::end(latches), 0x3FFF);
+	}
+
+	// Whether the target listens to a command at time t.
+	bool accepts(Clock::time_point t) {
+		if (!present || !programming_mode) return false;
+		if (t < busy_until) {
+			++timing_violations;
+			return false;
+		}
+		return true;
+	}
+
+	// Flash can only be programmed from 1 to 0. Only erasing sets bits.
+	void program_latches() {
+		if (in_configuration()) {
+			size_t i = address & 0x7FFF;
+			if (i < 4 || i == 7 || i == 8) configuration[i] &= latches[0];
+		} else if ((address & 0x7FFF) < 0x2000) {
+			size_t row = address & (program_size - 1) & ~(row_size - 1);
+			for (size_t i = 0; i < row_size; ++i) program[row + i] &= latches[i];
+		}
+		clear_latches();
+	}
+
+public:
+
+	EmulatedTarget() {
+		blank();
+	}
+
+	// Replace the chip by a new one, that was never programmed.
+	void blank() {
+		programming_mode = false;
+		std::fill(std::begin(program), std::end(program), 0x3FFF);
+		std::fill(std::begin(configuration), std::end(configuration), 0x3FFF);
+		configuration[4] = 0x0000;
+		configuration[9] = 0x0A1F; // Calibration words. (Arbitrary values.)
+		configuration[10] = 0x1C3A;
+		clear_latches();
+	}
+
+	void begin() {
+		programming_mode = true;
+		address = 0;
+		clear_latches();
+	}
+
+	void end() {
+		programming_mode = false;
+	}
+
+	void load_configuration(uint16_t v, Clock::time_point t) {
+		if (!accepts(t)) return;
+		address = 0x8000;
+		latches[0] = v;
+	}
+
+	void load_data(uint16_t v, Clock::time_point t) {
+		if (!accepts(t)) return;
+		latches[in_configuration() ? 0 : address & (row_size - 1)] = v;
+	}
+
+	uint16_t read_data(Clock::time_point t) {
+		if (!present || !programming_mode) return 0x3FFF;
+		if (!accepts(t)) return 0;
+		size_t i = address & 0x7FFF;
+		if (in_configuration()) {
+			if (i == 5) return revision_id;
+			if (i == 6) return device_id;
+			return i < 0x0B ? configuration[i] : 0;
+		}
+		return i < program_size ? program[i] : 0;
+	}
+
+	void increment_address(Clock::time_point t) {
+		if (!accepts(t)) return;
+		address = (address & 0x8000) | ((address + 1) & 0x7FFF);
+	}
+
+	void reset_address(Clock::time_point t) {
+		if (!accepts(t)) return;
+		address = 0;
+	}
+
+	void begin_programming(Clock::time_point t) {
+		if (!accepts(t)) return;
+		program_latches();
+		busy_until = t + (in_configuration() ? configuration_program_time : program_time);
+	}
+
+	void begin_externally_timed_programming(Clock::time_point t) {
+		if (!accepts(t)) return;
+		program_latches();
+		external_start = t;
+	}
+
+	void end_externally_timed_programming(Clock::time_point t) {
+		if (!accepts(t)) return;
+		if (t < external_start + external_program_time) ++timing_violations;
+		busy_until = t + discharge_time;
+	}
+
+	void bulk_erase(Clock::time_point t) {
+		if (!accepts(t)) return;
+		std::fill(std::begin(program), std::end(program), 0x3FFF);
+		configuration[7] = configuration[8] = 0x3FFF;
+		if (in_configuration()) std::fill(configuration, configuration + 4, 0x3FFF);
+		busy_until = t + bulk_erase_time;
+	}
+
+	void row_erase(Clock::time_point t) {
+		if (!accepts(t)) return;
+		size_t i = address & 0x7FFF;
+		if (in_configuration()) {
+			if (i < 4) std::fill(configuration, configuration + 4, 0x3FFF);
+		} else if (i < program_size) {
+			size_t row = i & ~(row_size - 1);
+			std::fill(program + row, program + row + row_size, 0x3FFF);
+		}
+		busy_until = t + row_erase_time;
+	}
+
+};
+
+// The programmer firmware, speaking the protocol described in README.md.
+//
+// Bytes from the host are given to receive(), together with the time they arrived.
+// Replies are put in `output`, together with the time at which the programmer has them ready.
+// Like the firmware, USB transfers in both directions continue while commands are executed.
+struct Emulator {
+
+	EmulatedTarget target;
+
+	std::string version = "PIC16F145x programmer 1.10 (emulated)\n";
+
+	// Time it takes to get a byte through USB, in either direction.
+	Clock::duration byte_time = std::chrono::microseconds(0);
+
+	// Time it takes to clock an ICSP command (including its data) in or out.
+	// Set by the 'F' command to 23 clock periods (6 command bits, 16 data bits, and TDLY).
+	Clock::duration icsp_time = std::chrono::microseconds(0);
+
+	std::deque<std::pair<Clock::time_point, uint8_t>> output;
+
+	void receive(uint8_t b, Clock::time_point t) {
+		received = std::max(received, t) + byte_time;
+		input.push_back(b);
+		while (step()) {}
+	}
+
+private:
+	// The time at which the last received byte got through USB.
+	Clock::time_point received;
+
+	// The time at which the programmer is done executing everything it received so far.
+	Clock::time_point time;
+
+	// The time at which the last reply got through USB.
+	Clock::time_point sent;
+
+	// Received bytes of a command that is not complete yet.
+	std::vector<uint8_t> input;
+
+	void reply(uint8_t b) {
+		sent = std::max(sent, time) + byte_time;
+		output.push_back(std::make_pair(sent, b));
+	}
+
+	void reply_value(uint16_t v) {
+		reply(0x80 | (v >> 7));
+		reply(0x80 | (v & 0x7F));
+	}
+
+	Clock::time_point icsp() {
+		time += icsp_time;
+		return time;
+	}
+
+	// Parse a parameter at input[i].
+	// Returns 0 if more bytes are needed, -1 for an invalid parameter, and 1 for a valid one.
+	// Like the firmware, an invalid byte is consumed.
+	int parameter(size_t & i, unsigned int & v) {
+		if (i >= input.size()) return 0;
+		uint8_t a = input[i++];
+		if (!(a & 0x80)) return -1;
+		if (i >= input.size()) return 0;
+		uint8_t b = input[i++];
+		if (!(b & 0x80)) return -1;
+		v = (a & 0x7F) << 7 | (b & 0x7F);
+		return 1;
+	}
+
+	// Execute the first command in `input`, if it is complete.
+	bool step() {
+		if (input.empty()) return false;
+		// (A command can't start before all of it was received. Until then, the programmer waits.)
+		time = std::max(time, received);
+		size_t i = 1;
+		unsigned int v, n;
+		int r;
+		switch (input[0]) {
+			case 'V': for (char c : version) reply(c); break;
+			case 'T': reply('Y'); break;
+			case 'B': target.begin(); break;
+			case 'E': target.end(); break;
+			case 'C':
+			case 'L':
+				if ((r = parameter(i, v)) == 0) return false;
+				if (r > 0) {
+					if (input[0] == 'C') target.load_configuration(v, icsp());
+					else target.load_data(v, icsp());
+				}
+				break;
+			case 'R': reply_value(target.read_data(icsp())); break;
+			case 'W': {
+				if ((r = parameter(i, n)) == 0) return false;
+				if (r < 0) break;
+				std::vector<uint16_t> values;
+				while (values.size() < n) {
+					if ((r = parameter(i, v)) == 0) return false;
+					if (r < 0) break;
+					values.push_back(v);
+				}
+				for (size_t j = 0; j < values.size(); ++j) {
+					target.load_data(values[j], icsp());
+					if (j + 1 < n) target.increment_address(icsp());
+				}
+				break;
+			}
+			case 'M': {
+				if ((r = parameter(i, n)) == 0) return false;
+				if (r < 0) break;
+				std::vector<uint16_t> values;
+				while (values.size() < n) {
+					if ((r = parameter(i, v)) == 0) return false;
+					if (r < 0) break;
+					values.push_back(v);
+				}
+				for (uint16_t value : values) {
+					reply_value(target.read_data(icsp()));
+					target.load_data(value, icsp());
+					target.increment_address(icsp());
+				}
+				break;
+			}
+			case 'D':
+				if ((r = parameter(i, n)) == 0) return false;
+				if (r > 0) {
+					for (size_t j = 0; j < n; ++j) {
+						reply_value(target.read_data(icsp()));
+						target.increment_address(icsp());
+					}
+				}
+				break;
+			case 'K':
+				if ((r = parameter(i, n)) == 0) return false;
+				if (r > 0) {
+					unsigned int a = 0, b = 0;
+					for (size_t j = 0; j < n; ++j) {
+						a = (a + target.read_data(icsp())) % 0xFFFF;
+						b = (b + a) % 0xFFFF;
+						target.increment_address(icsp());
+					}
+					reply_value(a & 0x3FFF);
+					reply_value(b & 0x3FFF);
+					reply_value(a >> 14 | (b >> 14) << 2);
+				}
+				break;
+			case 'I': target.increment_address(icsp()); break;
+			case 'J':
+				if ((r = parameter(i, n)) == 0) return false;
+				if (r > 0) for (size_t j = 0; j < n; ++j) target.increment_address(icsp());
+				break;
+			case 'A': target.reset_address(icsp()); break;
+			case 'P': target.begin_programming(icsp()); break;
+			case 'Q': target.begin_externally_timed_programming(icsp()); break;
+			case 'S': target.end_externally_timed_programming(icsp()); break;
+			case 'X': target.bulk_erase(icsp()); break;
+			case 'p':
+			case 'x':
+			case 'y':
+				if ((r = parameter(i, v)) == 0) return false;
+				if (r > 0) {
+					if (input[0] == 'p') target.begin_programming(icsp());
+					if (input[0] == 'x') target.bulk_erase(icsp());
+					if (input[0] == 'y') target.row_erase(icsp());
+					time += std::chrono::microseconds(v);
+					reply('Y');
+				}
+				break;
+			case 'Y': target.row_erase(icsp()); break;
+			case 'F':
+				if ((r = parameter(i, v)) == 0) return false;
+				if (r > 0 && v > 0) icsp_time = std::chrono::nanoseconds(23000000 / v);
+				break;
+			default: break;
+		}
+		input.erase(input.begin(), input.begin() + i);
+		return true;
+	}
+
+};
@@ -0,0 +1,123 @@
+// What `program` did to a target so far, kept in a file, such that `program --resume` can continue
+// where it stopped when it was interrupted, instead of starting over.
+//
+// There is a file for every target: every combination of port, device id and revision id.
+// It contains a few lines of text, which are added (and flushed) as soon as something is done:
+//   picp journal 1
+//   image <hash>     (MemoryDump::hash() of the image that is being programmed)
+//   erased           (once the bulk erase is done)
+//   row <address>    (for every row of program memory that was programmed and verified)
+// When everything is done, the file is removed.
+
+#include <string>
+#include <vector>
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct Journal {
+
+	// What the journal says, after open().
+	uint64_t image = 0;
+	bool erased = false;
+	std::vector<size_t> rows; // The addresses of the rows that are done, in order.
+
+	// Journals are kept in `directory`. If it's empty, nothing is kept.
+	Journal(std::string const & directory, std::string const & port) : directory(directory), port(port) {}
+
+	~Journal() {
+		if (file) fclose(file);
+	}
+
+	// Find and read the journal of a target. Returns whether there is one.
+	bool open(uint16_t device_id, uint16_t revision_id) {
+		close();
+		image = 0;
+		erased = false;
+		rows.clear();
+		if (directory.empty()) return false;
+		path = directory + "/";
+		for (char c : port) path += isalnum((unsigned char)c) ? c : '_';
+		char ids[16];
+		snprintf(ids, sizeof(ids), "-%04X-%04X", device_id, revision_id);
+		path += std::string(ids) + ".journal";
+
+		FILE * f = fopen(path.c_str(), "r");
+		if (!f) return false;
+		char line[64];
+		bool valid = fgets(line, sizeof(line), f) && std::string(line) == "picp journal 1\n";
+		while (valid && fgets(line, sizeof(line), f)) {
+			// (A line that was only partially written when picp was interrupted is ignored.)
+			unsigned long long h;
+			unsigned long a;
+			if (sscanf(line, "image %llx\n", &h) == 1) image = h;
+			else if (std::string(line) == "erased\n") erased = true;
+			else if (sscanf(line, "row %lu\n", &a) == 1) rows.push_back(a);
+		}
+		fclose(f);
+		return valid;
+	}
+
+	// Start over, for programming the given image. Returns false if the journal can't be written.
+	bool start(uint64_t image) {
+		if (path.empty()) return directory.empty();
+		close();
+		this->image = image;
+		erased = false;
+		rows.clear();
+		file = fopen(path.c_str(), "w");
+		if (!file) return false;
+		fprintf(file, "picp journal 1\nimage %016" PRIx64 "\n", image);
+		fflush(file);
+		return true;
+	}
+
+	// Continue the journal that was read by open(). Returns false if it can't be written.
+	bool resume() {
+		if (path.empty()) return directory.empty();
+		close();
+		file = fopen(path.c_str(), "a");
+		return file != 0;
+	}
+
+	void record_erased() {
+		erased = true;
+		record("erased\n");
+	}
+
+	void record_row(size_t address) {
+		rows.push_back(address);
+		char line[32];
+		snprintf(line, sizeof(line), "row %lu\n", (unsigned long)address);
+		record(line);
+	}
+
+	// Remove the journal, since there is nothing left to resume.
+	void complete() {
+		close();
+		if (!path.empty()) remove(path.c_str());
+	}
+
+private:
+	std::string directory;
+	std::string port;
+	std::string path;
+	FILE * file = 0;
+
+	Journal(Journal const &);
+	Journal & operator = (Journal const &);
+
+	void record(char const * line) {
+		if (!file) return;
+		fputs(line, file);
+		fflush(file);
+	}
+
+	void close() {
+		if (file) fclose(file);
+		file = 0;
+	}
+
+};
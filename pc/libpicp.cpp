@@ -0,0 +1,872 @@
+#include "libpicp.hpp"
+
+// The values of the hexadecimal digits, and -1 for all other characters.
+struct HexTable {
+	int8_t value[256];
+	HexTable() {
+		std::fill(std::begin(value), std::end(value), -1);
+		for (int i = 0; i < 10; ++i) value['0' + i] = i;
+		for (int i = 0; i < 6; ++i) value['A' + i] = value['a' + i] = 10 + i;
+	}
+};
+
+HexTable const hex_table;
+
+uint64_t MemoryDump::hash(uint16_t const * memory, uint16_t const * user_id, uint16_t const * configuration) {
+	uint64_t h = 0xCBF29CE484222325;
+	auto add = [&] (uint16_t const * words, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			h = (h ^ (words[i] & 0xFF)) * 0x100000001B3;
+			h = (h ^ (words[i] >> 8)) * 0x100000001B3;
+		}
+	};
+	add(memory, 0x2000);
+	add(user_id, 4);
+	add(configuration, 2);
+	return h;
+}
+
+uint64_t MemoryDump::hash() const {
+	return hash(memory, user_id, configuration);
+}
+
+void MemoryDump::update_row_used() {
+	row_used.reset();
+	for (size_t r = 0; r < rows; ++r) {
+		if (!row_populated[r]) continue;
+		for (size_t i = r * row_size; i < (r + 1) * row_size; ++i) {
+			if (memory[i] != 0x3FFF) {
+				row_used[r] = true;
+				break;
+			}
+		}
+	}
+}
+
+void MemoryDump::load(std::istream & in) {
+	std::string data;
+	char buffer[65536];
+	while (in) {
+		in.read(buffer, sizeof(buffer));
+		data.append(buffer, in.gcount());
+	}
+	load(data.data(), data.size());
+}
+
+void MemoryDump::load(char const * data, size_t size) {
+	if (size >= sizeof(image_magic) - 1 && memcmp(data, image_magic, sizeof(image_magic) - 1) == 0) {
+		load_image(data, size);
+	} else {
+		load_ihex(data, size);
+	}
+}
+
+void MemoryDump::save_image(std::ostream & out) const {
+	std::string data(image_size, '\0');
+	auto put = [&] (size_t offset, uint64_t value, size_t bytes) {
+		for (size_t i = 0; i < bytes; ++i) data[offset + i] = value >> (i * 8);
+	};
+	data.replace(0, 8, image_magic);
+	put(8, hash(), 8);
+	put(16, user_id_set | revision_id_set << 1 | device_id_set << 2 | configuration_set << 3, 2);
+	put(18, memory_used, 2);
+	for (size_t i = 0; i < 4; ++i) put(20 + i * 2, user_id[i], 2);
+	put(28, revision_id, 2);
+	put(30, device_id, 2);
+	for (size_t i = 0; i < 2; ++i) put(32 + i * 2, configuration[i], 2);
+	for (size_t r = 0; r < rows; ++r) {
+		data[36 + r / 8] |= row_populated[r] << (r % 8);
+		data[68 + r / 8] |= row_used[r] << (r % 8);
+	}
+	for (size_t i = 0; i < 0x2000; ++i) put(100 + i * 2, memory[i], 2);
+	out.write(data.data(), data.size());
+}
+
+void MemoryDump::load_image(char const * data, size_t size) {
+	if (size != image_size) throw std::runtime_error("Invalid image: wrong size.");
+	uint8_t const * d = reinterpret_cast<uint8_t const *>(data);
+	auto get = [&] (size_t offset) -> uint16_t { return d[offset] | d[offset + 1] << 8; };
+	uint64_t stored_hash = 0;
+	for (size_t i = 0; i < 8; ++i) stored_hash |= uint64_t(d[8 + i]) << (i * 8);
+	uint16_t flags = get(16);
+	user_id_set = flags & 1;
+	revision_id_set = flags & 2;
+	device_id_set = flags & 4;
+	configuration_set = flags & 8;
+	memory_used = get(18);
+	for (size_t i = 0; i < 4; ++i) user_id[i] = get(20 + i * 2);
+	revision_id = get(28);
+	device_id = get(30);
+	for (size_t i = 0; i < 2; ++i) configuration[i] = get(32 + i * 2);
+	for (size_t r = 0; r < rows; ++r) {
+		row_populated[r] = d[36 + r / 8] >> (r % 8) & 1;
+		row_used[r] = d[68 + r / 8] >> (r % 8) & 1;
+	}
+	for (size_t i = 0; i < 0x2000; ++i) memory[i] = get(100 + i * 2);
+	if (memory_used > 0x2000 || hash() != stored_hash) throw std::runtime_error("Invalid image: hash mismatch.");
+	// The hash only covers the contents, so check that the rest of the header agrees with them.
+	if (flags & ~0xF) throw std::runtime_error("Invalid image: unknown flags.");
+	if ((!revision_id_set && revision_id != 0) || (!device_id_set && device_id != 0) || revision_id > 0x3FFF || device_id > 0x3FFF) {
+		throw std::runtime_error("Invalid image: invalid device or revision id.");
+	}
+	for (size_t i = 0; i < 4; ++i) {
+		if (!user_id_set && user_id[i] != 0x3FFF) throw std::runtime_error("Invalid image: user id given, but not set.");
+	}
+	for (size_t i = 0; i < 2; ++i) {
+		if (!configuration_set && configuration[i] != 0x3FFF) throw std::runtime_error("Invalid image: configuration given, but not set.");
+	}
+	// The last populated row is the one with the last used word.
+	size_t const populated_end = (memory_used + row_size - 1) / row_size;
+	bool populated_valid = memory_used == 0 || row_populated[populated_end - 1];
+	for (size_t r = populated_end; r < rows; ++r) populated_valid &= !row_populated[r];
+	if (!populated_valid) throw std::runtime_error("Invalid image: populated rows do not match the used size.");
+	for (size_t i = 0; i < 0x2000; ++i) {
+		if (memory[i] > 0x3FFF || ((i >= memory_used || !row_populated[i / row_size]) && memory[i] != 0x3FFF)) {
+			throw std::runtime_error("Invalid image: data outside of the populated rows.");
+		}
+	}
+	std::bitset<rows> stored_row_used = row_used;
+	update_row_used();
+	if (row_used != stored_row_used) throw std::runtime_error("Invalid image: used rows do not match the data.");
+}
+
+void MemoryDump::load_ihex(char const * data, size_t size) {
+	IhexState state;
+	load_ihex_lines(data, size, state);
+	update_row_used();
+}
+
+void MemoryDump::load_ihex_lines(char const * data, size_t size, IhexState & state) {
+	char const * const end = data + size;
+	size_t address_offset = state.address_offset;
+	size_t line_number = state.line_number;
+	size_t lowest = 0x2000;
+	if (state.ended) return;
+	auto error = [&] (std::string const & message) {
+		throw std::runtime_error("Invalid Intel HEX data on line " + std::to_string(line_number) + ": " + message);
+	};
+	uint8_t record[5 + 255];
+	for (char const * line = data; line < end; ) {
+		++line_number;
+		char const * eol = static_cast<char const *>(memchr(line, '\n', end - line));
+		char const * next = eol ? eol + 1 : end;
+		if (!eol) eol = end;
+		while (eol > line && isspace(static_cast<unsigned char>(eol[-1]))) --eol;
+		if (line == eol || line[0] != ':') {
+			line = next;
+			continue;
+		}
+
+		// Decode the whole record, and check it, before looking at its contents.
+		char const * digits = line + 1;
+		size_t n = (eol - digits) / 2;
+		int8_t bad = 0;
+		for (size_t i = 0; i < n && i < sizeof(record); ++i) {
+			int8_t high = hex_table.value[static_cast<unsigned char>(digits[i * 2])];
+			int8_t low = hex_table.value[static_cast<unsigned char>(digits[i * 2 + 1])];
+			bad |= high | low;
+			record[i] = high << 4 | low;
+		}
+		if (bad < 0) error("not a hexadecimal digit.");
+		if (n < 5 || (eol - digits) % 2 != 0 || n != record[0] + 5u) error("record length does not match its byte count.");
+		uint8_t checksum = 0;
+		for (size_t i = 0; i < n; ++i) checksum += record[i];
+		if (checksum != 0) error("checksum mismatch.");
+		line = next;
+
+		size_t size = record[0];
+		size_t address = record[1] << 8 | record[2];
+		uint8_t type = record[3];
+		uint8_t const * payload = record + 4;
+		if (type == 0x00) {
+			if (size % 2 != 0 || address % 2 != 0) error("only data records with an even number of bytes on even addresses are supported.");
+			for (size_t i = 0; i < size / 2; ++i) {
+				size_t a = (address_offset + address) / 2 + i;
+				uint16_t value = (payload[i * 2 + 1] << 8 | payload[i * 2]) & 0x3FFF;
+				if (a < 0x2000) {
+					lowest = std::min(a, lowest);
+					memory[a] = value;
+					memory_used = std::max(a + 1, memory_used);
+					row_populated[a / row_size] = true;
+				} else if (a >= 0x8000 && a < 0x8004) {
+					user_id[a - 0x8000] = value;
+					user_id_set = true;
+				} else if (a == 0x8005) {
+					revision_id = value;
+					revision_id_set = true;
+				} else if (a == 0x8006) {
+					device_id = value;
+					device_id_set = true;
+				} else if (a >= 0x8007 && a < 0x8009) {
+					configuration[a - 0x8007] = value;
+					configuration_set = true;
+				} else if (a >= 0x8000 && a <= 0x800A) {
+					// ignore
+				} else {
+					std::stringstream s;
+					s << "data for invalid address 0x" << std::hex << a << ".";
+					error(s.str());
+				}
+			}
+		} else if (type == 0x01) {
+			state.ended = true;
+			break;
+		} else if (type == 0x02 && size == 2) {
+			address_offset = payload[0] << 12 | payload[1] << 4;
+		} else if (type == 0x04 && size == 2) {
+			address_offset = payload[0] << 24 | payload[1] << 16;
+		} else if (type == 0x03 || type == 0x05) {
+			// Start address. Not relevant for a PIC.
+		} else {
+			std::stringstream s;
+			s << "unknown record type 0x" << std::hex << unsigned(type) << " (size " << std::dec << size << ").";
+			error(s.str());
+		}
+	}
+	state.address_offset = address_offset;
+	state.line_number = line_number;
+	state.lowest = lowest;
+}
+
+char const MemoryDump::image_magic[9] = "PICPIMG1";
+
+void ImageStream::feed(char const * data, size_t size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	pending.append(data, size);
+	size_t const magic_size = sizeof(MemoryDump::image_magic) - 1;
+	if (compiled) return;
+	if (state.line_number == 0 && pending.compare(0, magic_size, MemoryDump::image_magic, std::min(pending.size(), magic_size)) == 0) {
+		// This might be a compiled image, which is loaded as a whole when it's complete.
+		compiled = pending.size() >= magic_size;
+		return;
+	}
+	size_t end = pending.rfind('\n');
+	if (end == std::string::npos) return;
+	parsed.load_ihex_lines(pending.data(), end + 1, state);
+	pending.erase(0, end + 1);
+	if (state.lowest < final_rows * MemoryDump::row_size) in_order = false;
+	if (in_order && parsed.memory_used / MemoryDump::row_size > final_rows) {
+		final_rows = parsed.memory_used / MemoryDump::row_size;
+		changed.notify_all();
+	}
+}
+
+void ImageStream::finish() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (compiled) {
+		parsed.load(pending.data(), pending.size());
+	} else {
+		parsed.load_ihex_lines(pending.data(), pending.size(), state);
+		parsed.update_row_used();
+	}
+	pending.clear();
+	finished = true;
+	changed.notify_all();
+}
+
+void ImageStream::fail(std::exception_ptr e) {
+	std::lock_guard<std::mutex> lock(mutex);
+	error = e;
+	changed.notify_all();
+}
+
+size_t ImageStream::wait(size_t words) {
+	size_t const row_size = MemoryDump::row_size;
+	std::unique_lock<std::mutex> lock(mutex);
+	changed.wait(lock, [&] { return final_rows * row_size > words || finished || error; });
+	if (error) std::rethrow_exception(error);
+	if (finished) {
+		for (size_t r = 0; r < published; ++r) {
+			rewritten[r] = !std::equal(&image.memory[r * row_size], &image.memory[(r + 1) * row_size], &parsed.memory[r * row_size]);
+		}
+		image = parsed;
+		complete = true;
+		published = (image.memory_used + row_size - 1) / row_size;
+		return published * row_size;
+	}
+	for (size_t r = published; r < final_rows; ++r) {
+		std::copy(&parsed.memory[r * row_size], &parsed.memory[(r + 1) * row_size], &image.memory[r * row_size]);
+		image.row_populated[r] = parsed.row_populated[r];
+		image.row_used[r] = parsed.row_populated[r] && std::any_of(&image.memory[r * row_size], &image.memory[(r + 1) * row_size], [] (uint16_t v) {
+			return v != 0x3FFF;
+		});
+	}
+	// (The last final row might be partially given, but all its other words are erased anyway.)
+	image.memory_used = final_rows * row_size;
+	published = final_rows;
+	return published * row_size;
+}
+
+std::string hex_word(uint16_t v) {
+	std::stringstream s;
+	s << std::hex << std::setfill('0') << std::setw(4) << v;
+	return s.str();
+}
+
+static void verify_failure(char const * part, uint16_t good, uint16_t bad) {
+	std::stringstream s;
+	s << "Verification failure in " << part << ": ";
+	s << "0x" << hex_word(good) << " was written, but ";
+	s << "0x" << hex_word(bad) << " was read.";
+	throw std::runtime_error(s.str());
+}
+
+void Session::connect() {
+	phase("connect");
+	log << "Resetting target..." << std::endl;
+	d.end();
+	d.delay(250000);
+	if (!identify()) throw std::runtime_error("No target found.");
+	device = find_device(device_id);
+	if (device) {
+		log << "Connected to " << device->name << "." << std::endl;
+	} else {
+		device = &devices[0];
+		log << "Connected to unknown device " << hex_word(device_id) << ". Treating it like a " << device->name << "." << std::endl;
+	}
+	if (device->device_id_mask != 0x3FFF) revision_id = device_id & ~device->device_id_mask;
+}
+
+bool Session::detect() {
+	d.end();
+	bool found = identify();
+	d.end();
+	d.flush();
+	device = 0;
+	return found;
+}
+
+bool Session::identify() {
+	d.begin();
+	d.load_configuration(0);
+	for (size_t i = 0; i < 5; ++i) d.increment_address();
+	d.read_sequence(2, [&] (size_t i, uint16_t v) {
+		(i == 0 ? revision_id : device_id) = v;
+	});
+	return device_id != 0x3FFF && device_id != 0;
+}
+
+void Session::check_image(MemoryDump const & m) {
+	ensure_connected();
+	if (m.memory_used > device->program_size) {
+		throw std::runtime_error("The image does not fit in the " + hex_word(device->program_size) + " words of program memory of the " + device->name + ".");
+	}
+	if (m.device_id_set) {
+		if ((m.device_id & device->device_id_mask) == (device_id & device->device_id_mask)) {
+			log << "Device ID matches." << std::endl;
+		} else {
+			throw std::runtime_error("Device ID does not match (hex file: " + hex_word(m.device_id) + ", device: " + hex_word(device_id) + ").");
+		}
+	}
+	if (m.revision_id_set) {
+		if (m.revision_id == revision_id) {
+			log << "Revision ID matches." << std::endl;
+		} else {
+			throw std::runtime_error("Revision ID does not match (hex file: " + hex_word(m.revision_id) + ", device: " + hex_word(revision_id) + ").");
+		}
+	}
+}
+
+std::vector<bool> Session::compare_rows(MemoryDump const & m, bool fast, uint16_t * current) {
+	size_t const row_size = device->row_size;
+	size_t const rows = device->program_size / row_size;
+	std::vector<bool> differs(rows);
+	reset_address();
+	if (fast && d.has_checksums()) {
+		std::vector<Icsp::Reply> checksums(rows);
+		for (size_t r = 0; r < rows; ++r) checksums[r] = d.checksum_async(row_size);
+		address = device->program_size;
+		for (size_t r = 0; r < rows; ++r) {
+			differs[r] = d.get_checksum(checksums[r]) != Icsp::checksum(&m.memory[r * row_size], row_size);
+			progress(r + 1, rows);
+		}
+		reset_address();
+		for (size_t r = 0; r < rows; ++r) {
+			if (!differs[r]) continue;
+			go_to(r * row_size);
+			d.read_sequence(row_size, [&] (size_t i, uint16_t v) {
+				current[r * row_size + i] = v;
+			});
+			address += row_size;
+		}
+	} else {
+		if (fast) log << "The programmer does not support checksums. Reading everything instead." << std::endl;
+		d.read_sequence(device->program_size, [&] (size_t a, uint16_t v) {
+			current[a] = v;
+			if (v != m.memory[a]) differs[a / row_size] = true;
+			progress(a + 1, device->program_size);
+		});
+		address = device->program_size;
+	}
+	return differs;
+}
+
+void Session::verify(MemoryDump const & m, bool fast) {
+	ensure_connected();
+	phase("verify");
+	log << "Verifying program memory..." << std::endl;
+	std::vector<uint16_t> current(device->program_size);
+	std::vector<bool> row_differs = compare_rows(m, fast, current.data());
+	size_t failures = 0;
+	auto failure = [&] (unsigned int a, uint16_t expected, uint16_t v) {
+		if (++failures <= 20) log << hex_word(a) << ": 0x" << hex_word(expected) << " was expected, but 0x" << hex_word(v) << " was read." << std::endl;
+		else if (failures == 21) log << "..." << std::endl;
+	};
+	for (size_t a = 0; a < device->program_size; ++a) {
+		if (row_differs[a / device->row_size] && current[a] != m.memory[a]) failure(a, m.memory[a], current[a]);
+	}
+	if (m.user_id_set || m.configuration_set) {
+		log << "Verifying configuration..." << std::endl;
+		d.load_configuration(0);
+		d.read_sequence(9, [&] (size_t i, uint16_t v) {
+			uint16_t expected = v;
+			if (i < 4 && m.user_id_set) expected = m.user_id[i];
+			if (i >= 7 && m.configuration_set) expected = m.configuration[i - 7];
+			if (v != expected) failure(0x8000 + i, expected, v);
+		});
+	}
+	if (failures) throw std::runtime_error("Verification failed (" + std::to_string(failures) + " differences).");
+	log << "Everything matches." << std::endl;
+}
+
+void Session::write_configuration_word(uint16_t value, char const * part) {
+	d.load_data(value);
+	d.program_row(device->configuration_program_time);
+	uint16_t v = d.read_data();
+	if (v != value) verify_failure(part, value, v);
+	d.increment_address();
+}
+
+void Session::program(MemoryDump const & m, bool incremental) {
+	ensure_connected();
+	uint16_t current_configuration[9];
+	bool user_id_differs = false;
+	bool user_id_needs_erase = false;
+	bool configuration_differs = false;
+	if (incremental) {
+		phase("compare");
+		log << "Reading configuration..." << std::endl;
+		d.load_configuration(0);
+		d.read_sequence(9, [&] (size_t i, uint16_t v) {
+			current_configuration[i] = v;
+		});
+		if (m.user_id_set) {
+			for (size_t i = 0; i < 4; ++i) {
+				user_id_differs |= m.user_id[i] != current_configuration[i];
+				user_id_needs_erase |= (m.user_id[i] & ~current_configuration[i]) != 0;
+			}
+		}
+		if (m.configuration_set) {
+			for (size_t i = 0; i < 2; ++i) {
+				configuration_differs |= m.configuration[i] != current_configuration[7 + i];
+				// Configuration words can only be erased by a bulk erase.
+				if (m.configuration[i] & ~current_configuration[7 + i]) incremental = false;
+			}
+		}
+		if (!incremental) log << "The configuration bits can not be changed without erasing everything." << std::endl;
+	}
+
+	if (incremental) {
+		size_t const row_size = device->row_size;
+		size_t const rows = device->program_size / row_size;
+		log << "Comparing program memory..." << std::endl;
+		std::vector<uint16_t> current(device->program_size);
+		// Rows with the same checksum are skipped, so this relies on Icsp::has_checksums() rejecting
+		// the firmware of which the checksum can't tell 0x3FFF from 0x0000.
+		std::vector<bool> row_differs = compare_rows(m, true, current.data());
+		std::vector<bool> row_needs_erase(rows);
+		for (size_t a = 0; a < device->program_size; ++a) {
+			if (row_differs[a / row_size] && (m.memory[a] & ~current[a])) row_needs_erase[a / row_size] = true;
+		}
+		size_t n_differ = std::count(row_differs.begin(), row_differs.end(), true);
+		phase("write");
+		log << "Writing " << n_differ << " of " << rows << " rows to program memory..." << std::endl;
+		reset_address();
+		size_t done = 0;
+		for (size_t r = 0; r < rows; ++r) {
+			if (!row_differs[r]) continue;
+			go_to(r * row_size);
+			if (row_needs_erase[r]) {
+				d.erase_row(device->row_erase_time);
+			}
+			d.load_block(&m.memory[r * row_size], row_size);
+			d.program_row(device->program_time);
+			d.increment_address();
+			address += row_size;
+			progress(++done, n_differ);
+		}
+		phase("verify");
+		log << "Verifying program memory..." << std::endl;
+		reset_address();
+		for (size_t r = 0; r < rows; ++r) {
+			if (!row_differs[r]) continue;
+			go_to(r * row_size);
+			d.read_sequence(row_size, [&] (size_t i, uint16_t v) {
+				if (v != m.memory[r * row_size + i]) verify_failure("program memory", m.memory[r * row_size + i], v);
+			});
+			address += row_size;
+		}
+		if (user_id_differs || configuration_differs) phase("config");
+		if (user_id_differs) {
+			log << "Writing and verifying user id..." << std::endl;
+			d.load_configuration(0);
+			if (user_id_needs_erase) {
+				d.erase_row(device->row_erase_time);
+			}
+			for (size_t i = 0; i < 4; ++i) write_configuration_word(m.user_id[i], "user id");
+		}
+		if (configuration_differs) {
+			log << "Writing and verifying configuration bits..." << std::endl;
+			d.load_configuration(0);
+			for (size_t i = 0; i < 7; ++i) d.increment_address();
+			for (size_t i = 0; i < 2; ++i) write_configuration_word(m.configuration[i], "configuration bits");
+		}
+		log << "Done." << std::endl;
+	} else {
+		if (!m.configuration_set) {
+			log << "Warning: No configuration bits are given. The configuration bits will be erased but not programmed, thus left at all bits set." << std::endl;
+		}
+		if (journal) {
+			journal->open(device_id, revision_id);
+			if (!journal->start(m.hash())) log << "Warning: Unable to write the journal. Continuing without." << std::endl;
+		}
+		phase("erase");
+		log << "Erasing..." << std::endl;
+		if (m.user_id_set) {
+			d.load_configuration(0);
+		} else {
+			d.reset_address();
+		}
+		d.erase(device->bulk_erase_time);
+		if (journal) journal->record_erased();
+		size_t const row_size = device->row_size;
+		size_t const used_rows = (m.memory_used + row_size - 1) / row_size;
+		std::vector<bool> row_used(used_rows);
+		for (size_t r = 0; r < used_rows; ++r) row_used[r] = m.used(r * row_size, row_size);
+		size_t const skipped_rows = std::count(row_used.begin(), row_used.end(), false);
+		log << "Writing " << m.memory_used << " words to program memory";
+		if (skipped_rows) log << " (skipping " << skipped_rows << " blank rows)";
+		log << "..." << std::endl;
+		write_erased(m, row_used);
+	}
+	if (journal) {
+		// (Also when the journal was left by an earlier session, that is now finished in another way.)
+		journal->open(device_id, revision_id);
+		journal->complete();
+	}
+}
+
+void Session::resume(MemoryDump const & m) {
+	ensure_connected();
+	if (!journal || !journal->open(device_id, revision_id) || !journal->erased) {
+		log << "Nothing to resume." << std::endl;
+		program(m, false);
+		return;
+	}
+	if (journal->image != m.hash()) {
+		log << "The interrupted session was programming a different image." << std::endl;
+		program(m, false);
+		return;
+	}
+
+	size_t const row_size = device->row_size;
+	size_t const used_rows = (m.memory_used + row_size - 1) / row_size;
+	std::vector<bool> row_write(used_rows);
+	for (size_t r = 0; r < used_rows; ++r) row_write[r] = m.used(r * row_size, row_size);
+	size_t const total = std::count(row_write.begin(), row_write.end(), true);
+	for (size_t a : journal->rows) {
+		if (a / row_size < used_rows) row_write[a / row_size] = false;
+	}
+	size_t const remaining = std::count(row_write.begin(), row_write.end(), true);
+
+	// The rows in the journal were verified already. Check the last ones again, to make sure
+	// that this is really the same target, and that nothing happened to it in the meantime.
+	phase("compare");
+	bool same = true;
+	reset_address();
+	size_t const n_check = std::min<size_t>(journal->rows.size(), 2);
+	for (size_t i = journal->rows.size() - n_check; i < journal->rows.size(); ++i) {
+		size_t a = journal->rows[i];
+		if (a < address || a >= m.memory_used) continue;
+		size_t n = std::min<size_t>(row_size, m.memory_used - a);
+		go_to(a);
+		d.read_sequence(n, [&] (size_t j, uint16_t v) {
+			if (v != m.memory[a + j]) same = false;
+		});
+		address += n;
+	}
+	if (!same) {
+		log << "The target does not match the journal of the interrupted session." << std::endl;
+		program(m, false);
+		return;
+	}
+
+	if (!journal->resume()) {
+		log << "Warning: Unable to write the journal. Continuing without." << std::endl;
+	}
+	log << "Resuming: " << total - remaining << " of " << total << " rows were done already." << std::endl;
+	log << "Writing the remaining " << remaining << " rows to program memory..." << std::endl;
+	write_erased(m, row_write);
+	journal->complete();
+}
+
+static void report_written(std::ostream & log, size_t words, std::chrono::steady_clock::time_point start) {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::stringstream s;
+	s << std::fixed << std::setprecision(2) << seconds << " s (" << std::setprecision(0) << words / seconds << " words/s)";
+	log << "Wrote and verified " << words << " words in " << s.str() << "." << std::endl;
+}
+
+void Session::program(ImageStream & stream) {
+	ensure_connected();
+	MemoryDump const & m = stream.image;
+	size_t const row_size = device->row_size;
+	phase("erase");
+	log << "Erasing..." << std::endl;
+	reset_address();
+	d.erase(device->bulk_erase_time);
+	log << "Writing program memory while reading the image..." << std::endl;
+	auto start = std::chrono::steady_clock::now();
+	size_t rows = 0; // The (device) rows that were done already.
+	size_t verified = 0;
+	while (!stream.complete) {
+		phase("wait");
+		size_t words = stream.wait(rows * row_size);
+		check_image(m);
+		if (stream.rewritten.any()) {
+			std::vector<bool> row_rewritten(rows);
+			for (size_t r = 0; r < rows; ++r) row_rewritten[r] = stream.was_rewritten(r * row_size, row_size);
+			size_t n_rewritten = std::count(row_rewritten.begin(), row_rewritten.end(), true);
+			log << "The image changes " << n_rewritten << " rows that were written already. Writing them again..." << std::endl;
+			phase("erase");
+			reset_address();
+			std::vector<bool> row_write(rows);
+			for (size_t r = 0; r < rows; ++r) {
+				if (!row_rewritten[r]) continue;
+				go_to(r * row_size);
+				d.erase_row(device->row_erase_time);
+				row_write[r] = m.used(r * row_size, row_size);
+			}
+			verified += write_rows(m, row_write, 0);
+		}
+		size_t n = (words + row_size - 1) / row_size;
+		if (n == rows) continue;
+		std::vector<bool> row_write(n);
+		for (size_t r = rows; r < n; ++r) row_write[r] = m.used(r * row_size, row_size);
+		verified += write_rows(m, row_write, rows);
+		rows = n;
+	}
+	report_written(log, verified, start);
+	if (!m.configuration_set) {
+		log << "Warning: No configuration bits are given. The configuration bits are erased but not programmed, thus left at all bits set." << std::endl;
+	}
+	write_config(m, false);
+	log << "Done." << std::endl;
+	if (journal) {
+		// Nothing to resume from a stream, but a journal of an earlier session is finished now.
+		journal->open(device_id, revision_id);
+		journal->complete();
+	}
+}
+
+void Session::write_erased(MemoryDump const & m, std::vector<bool> const & row_write) {
+	auto start = std::chrono::steady_clock::now();
+	size_t verified = write_rows(m, row_write, 0);
+	report_written(log, verified, start);
+	write_config(m, true);
+	log << "Done." << std::endl;
+}
+
+size_t Session::write_rows(MemoryDump const & m, std::vector<bool> const & row_write, size_t first) {
+	size_t const row_size = device->row_size;
+	size_t const rows = row_write.size();
+	phase("write");
+	reset_address();
+	if (d.has_read_and_load()) return program_and_verify_rows(m, row_write, first);
+	for (size_t r = first; r < rows; ++r) {
+		if (row_write[r]) {
+			size_t a = r * row_size;
+			size_t n = std::min<size_t>(row_size, m.memory_used - a);
+			go_to(a);
+			d.load_block(&m.memory[a], n);
+			d.program_row(device->program_time);
+			d.increment_address();
+			address += n;
+		}
+		progress(r + 1, rows);
+	}
+	phase("verify");
+	log << "Verifying program memory..." << std::endl;
+	reset_address();
+	size_t to_verify = 0;
+	for (size_t r = first; r < rows; ++r) {
+		if (row_write[r]) to_verify += std::min<size_t>(row_size, m.memory_used - r * row_size);
+	}
+	size_t verified = 0;
+	for (size_t r = first; r < rows; ++r) {
+		if (!row_write[r]) continue;
+		// Read a whole run of rows at once, to keep the reads pipelined.
+		size_t end = r;
+		while (end < rows && row_write[end]) ++end;
+		size_t a = r * row_size;
+		size_t n = std::min(end * row_size, m.memory_used) - a;
+		go_to(a);
+		d.read_sequence(n, [&] (size_t i, uint16_t v) {
+			if (v != m.memory[a + i]) verify_failure("program memory", m.memory[a + i], v);
+			progress(verified + i + 1, to_verify);
+		});
+		address += n;
+		verified += n;
+		if (journal) for (size_t x = r; x < end; ++x) journal->record_row(x * row_size);
+		r = end;
+	}
+	return verified;
+}
+
+void Session::write_config(MemoryDump const & m, bool user_id_erased) {
+	if (!m.configuration_set && !m.user_id_set) return;
+	phase("config");
+	d.load_configuration(0);
+	if (m.user_id_set) {
+		if (!user_id_erased) {
+			bool needs_erase = false;
+			d.read_sequence(4, [&] (size_t i, uint16_t v) {
+				needs_erase |= (m.user_id[i] & ~v) != 0;
+			});
+			d.load_configuration(0);
+			if (needs_erase) d.erase_row(device->row_erase_time);
+		}
+		log << "Writing and verifying user id..." << std::endl;
+		for (size_t i = 0; i < 4; ++i) {
+			write_configuration_word(m.user_id[i], "user id");
+			progress(i, 3);
+		}
+	}
+	if (m.configuration_set) {
+		for (size_t i = 0; i < (m.user_id_set ? 3 : 7); ++i) d.increment_address();
+		log << "Writing and verifying configuration bits..." << std::endl;
+		for (size_t i = 0; i < 2; ++i) {
+			write_configuration_word(m.configuration[i], "configuration bits");
+			progress(i, 1);
+		}
+	}
+}
+
+// The address can't go back to a row after programming it, so a row is read back while the next row is
+// loaded into the write latches, which only look at the lower bits of the address. The next row is then
+// programmed as soon as the address reaches it, and the following commands (that read it back again)
+// are sent while the programmer is still waiting for that.
+size_t Session::program_and_verify_rows(MemoryDump const & m, std::vector<bool> const & row_write, size_t first) {
+	size_t const row_size = device->row_size;
+	size_t const rows = row_write.size();
+	auto words = [&] (size_t r) {
+		return std::min<size_t>(row_size, m.memory_used - r * row_size);
+	};
+
+	// Rows that are read back, but not checked yet.
+	struct Check { Icsp::Reply first; size_t address; size_t count; };
+	std::deque<Check> checks;
+	size_t verified = 0;
+	auto check = [&] {
+		Check c = checks.front();
+		checks.pop_front();
+		for (size_t i = 0; i < c.count; ++i) {
+			uint16_t v = d.get(c.first + i);
+			if (v != m.memory[c.address + i]) verify_failure("program memory", m.memory[c.address + i], v);
+		}
+		verified += c.count;
+		if (journal) journal->record_row(c.address);
+	};
+
+	// The first row has no row before it, so it's loaded in place instead, after which the address goes back.
+	if (first < rows && row_write[first]) {
+		go_to(first * row_size);
+		d.load_block(&m.memory[first * row_size], words(first));
+		reset_address();
+		go_to(first * row_size);
+		d.program_row_async(device->program_time);
+	}
+
+	for (size_t r = first; r < rows; ++r) {
+		size_t a = r * row_size;
+		size_t reads = row_write[r] ? words(r) : 0;
+		size_t loads = r + 1 < rows && row_write[r + 1] ? words(r + 1) : 0;
+		size_t both = std::min(reads, loads);
+		if (!reads && !loads) {
+			progress(r + 1, rows);
+			continue;
+		}
+		go_to(a);
+		Icsp::Reply first = 0;
+		if (both) first = d.read_and_load_async(&m.memory[a + row_size], both);
+		if (reads > both) {
+			Icsp::Reply f = d.read_block_async(reads - both);
+			if (!both) first = f;
+		}
+		if (loads > both) {
+			d.load_block(&m.memory[a + row_size + both], loads - both);
+			d.increment_address();
+		}
+		address = a + std::max(reads, loads);
+		if (reads) checks.push_back(Check{first, a, reads});
+		if (loads) {
+			go_to(a + row_size);
+			d.program_row_async(device->program_time);
+		}
+		// Send what was just queued, while the programmer is still busy with the previous row,
+		// and check the rows before this one, which are (almost) received already.
+		d.flush();
+		while (checks.size() > 1) check();
+		progress(r + 1, rows);
+	}
+	while (!checks.empty()) check();
+	return verified;
+}
+
+std::vector<uint16_t> Session::read_program(size_t start, size_t count) {
+	ensure_connected();
+	std::vector<uint16_t> memory(count);
+	reset_address();
+	go_to(start);
+	d.read_sequence(count, [&] (size_t i, uint16_t v) {
+		memory[i] = v;
+		progress(i + 1, count);
+	});
+	address += count;
+	return memory;
+}
+
+std::vector<uint16_t> Session::read_config() {
+	ensure_connected();
+	std::vector<uint16_t> configuration(device->configuration_size);
+	d.load_configuration(0);
+	d.read_sequence(configuration.size(), [&] (size_t i, uint16_t v) {
+		configuration[i] = v;
+	});
+	return configuration;
+}
+
+uint64_t Session::hash() {
+	ensure_connected();
+	// Memory that the chip doesn't have counts as erased, like in an image.
+	std::vector<uint16_t> memory = read_program(0, device ? device->program_size : 0);
+	memory.resize(0x2000, 0x3FFF);
+	std::vector<uint16_t> configuration = read_config();
+	return MemoryDump::hash(memory.data(), &configuration[0], &configuration[7]);
+}
+
+void Session::erase(bool user_id) {
+	ensure_connected();
+	if (user_id) {
+		d.load_configuration(0);
+	} else {
+		reset_address();
+	}
+	d.erase(device->bulk_erase_time);
+}
+
+void Session::end() {
+	d.end();
+	d.flush();
+	device = 0;
+}
@@ -0,0 +1,738 @@
+// libpicp: everything needed to program a chip with picp, without any user interface.
+//
+// A Port (see linux.hpp and windows.hpp) is the connection to the programmer, Icsp speaks
+// its protocol, MemoryDump holds an image, and a Session does the work on the target.
+// A Programmer puts all of those together. Nothing is written to stdout or stderr,
+// and errors are thrown as std::runtime_error.
+
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "journal.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+#if defined(PICP_MOCK_PORT)
+#include "mock.hpp"
+#elif defined(PICP_REPLAY_PORT)
+#include "replay.hpp"
+#elif defined(_WIN32)
+#include "windows.hpp"
+#else
+#include "linux.hpp"
+#endif
+
+#include "devices.hpp"
+
+struct Icsp {
+
+	Port & p;
+
+	// Maximum number of replies that may be requested without being received yet.
+	// Firmware older than 1.2 drops replies that are queued while the previous one is still being sent,
+	// so version() sets this to 1 for those.
+	size_t window = 128;
+
+	unsigned int firmware_major = 0;
+	unsigned int firmware_minor = 0;
+
+	// Time spent sleeping in delay(), in seconds.
+	double sleep_time = 0;
+
+	// A reply that is requested but not necessarily received yet. See get().
+	typedef size_t Reply;
+
+private:
+	// Replies are numbered in the order they are requested.
+	// `received` holds the replies [first_reply, first_reply + received.size()).
+	Reply next_reply = 0;
+	Reply first_reply = 0;
+	std::deque<uint16_t> received;
+
+	// The replies that are a single 'Y' (from a timed command), instead of a value.
+	std::deque<Reply> acks;
+
+	size_t in_flight() const {
+		return next_reply - first_reply - received.size();
+	}
+
+	void receive() {
+		if (!acks.empty() && acks.front() == first_reply + received.size()) {
+			acks.pop_front();
+			if (p.read() != 'Y') throw std::runtime_error("Got invalid reply.");
+			received.push_back('Y');
+		} else {
+			received.push_back(read_value());
+		}
+	}
+
+	// Receive all replies in flight, such that the next byte read is a reply to something else.
+	void drain() {
+		while (in_flight()) receive();
+	}
+
+public:
+
+	Icsp(Port & p) : p(p) {
+		p.write(' ');
+	}
+
+	// Ask for the version twice, and use the second reply. Replies that were still queued by
+	// an earlier interrupted run end up in front of the first one, which is thrown away.
+	std::string version() {
+		p.write('V');
+		p.write('V');
+		drain();
+		p.flush();
+		std::string version;
+		for (int lines = 0; lines < 2;) {
+			char c = p.read();
+			if (c == '\n') ++lines;
+			else if (lines == 1) version += c;
+		}
+		size_t i = version.find("programmer ");
+		if (i == std::string::npos || sscanf(version.c_str() + i, "programmer %u.%u", &firmware_major, &firmware_minor) != 2) {
+			firmware_major = firmware_minor = 0;
+		}
+		if (!firmware_at_least(1, 2)) window = 1;
+		return version;
+	}
+
+	bool firmware_at_least(unsigned int major, unsigned int minor) const {
+		return firmware_major > major || (firmware_major == major && firmware_minor >= minor);
+	}
+
+	void write_value(uint16_t value) {
+		p.write(0x80 | (value >> 7));
+		p.write(0x80 | (value & 0x7F));
+	}
+
+	void test() {
+		p.write('T');
+		drain();
+		p.flush();
+		if (p.read() != 'Y') throw std::runtime_error("Got invalid reply.");
+	}
+
+	uint16_t read_value() {
+		p.flush();
+		uint8_t a = p.read();
+		uint8_t b = p.read();
+		if (!(a & b & 0x80)) throw std::runtime_error("Invalid data received.");
+		return (a & 0x7F) << 7 | (b & 0x7F);
+	}
+
+	// Send everything queued so far, and give the programmer some time.
+	// Note that the time starts before the programmer has received everything,
+	// so use test() first to wait for a target operation to start,
+	// or better, use program_row(), erase() or erase_row().
+	void delay(unsigned int microseconds) {
+		p.flush();
+		auto start = std::chrono::steady_clock::now();
+		usleep(microseconds);
+		sleep_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void flush() { p.flush(); }
+
+	// Whether the firmware supports the 'W' and 'D' block commands.
+	bool has_blocks() const {
+		return firmware_at_least(1, 3);
+	}
+
+	// Request a word from program memory, without waiting for it.
+	Reply read_data_async() {
+		while (in_flight() >= window) receive();
+		p.write('R');
+		return next_reply++;
+	}
+
+	// Request `count` consecutive words, starting at the current address, without waiting for them.
+	// Returns the Reply of the first word; the others follow it.
+	// Leaves the address right after the last word.
+	Reply read_block_async(size_t count) {
+		Reply first = next_reply;
+		while (count > 0) {
+			size_t n = std::min<size_t>(count, has_blocks() ? 0x3FFF : 1);
+			while (in_flight() && in_flight() + n > window) receive();
+			if (has_blocks()) {
+				p.write('D');
+				write_value(n);
+			} else {
+				p.write('R');
+				p.write('I');
+			}
+			next_reply += n;
+			count -= n;
+		}
+		return first;
+	}
+
+	// Whether the firmware supports the 'K' (checksum) command.
+	// (Versions 1.7 to 1.9 have a 'K' command too, but their checksum can't tell 0x3FFF from 0x0000.)
+	bool has_checksums() const {
+		return firmware_at_least(1, 10);
+	}
+
+	// The checksum that the 'K' command calculates: A Fletcher checksum over the words, modulo 0xFFFF.
+	// Sum of the words in the low 16 bits, sum of those sums in the high 16 bits.
+	static uint32_t checksum(uint16_t const * data, size_t count) {
+		uint32_t a = 0, b = 0;
+		for (size_t i = 0; i < count; ++i) {
+			a = (a + data[i]) % 0xFFFF;
+			b = (b + a) % 0xFFFF;
+		}
+		return b << 16 | a;
+	}
+
+	// Request the checksum of `count` (at most 0x3FFF) words starting at the current address, without waiting for it.
+	// Leaves the address right after the last word. Use get_checksum() to get the result.
+	Reply checksum_async(size_t count) {
+		while (in_flight() && in_flight() + 3 > window) receive();
+		p.write('K');
+		write_value(count);
+		next_reply += 3;
+		return next_reply - 3;
+	}
+
+	uint32_t get_checksum(Reply r) {
+		uint16_t a = get(r);
+		uint16_t b = get(r + 1);
+		uint16_t high = get(r + 2);
+		a |= (high & 3) << 14;
+		b |= (high >> 2 & 3) << 14;
+		return uint32_t(b) << 16 | a;
+	}
+
+	// Load `count` words into consecutive addresses, starting at the current address.
+	// Leaves the address at the last word, so the row containing it can be programmed right away.
+	void load_block(uint16_t const * data, size_t count) {
+		while (count > 0) {
+			size_t n = std::min<size_t>(count, has_blocks() ? 0x3FFF : 1);
+			if (has_blocks()) {
+				p.write('W');
+				write_value(n);
+				for (size_t i = 0; i < n; ++i) write_value(data[i]);
+			} else {
+				load_data(data[0]);
+			}
+			data += n;
+			count -= n;
+			if (count > 0) increment_address();
+		}
+	}
+
+	// Whether the firmware supports the 'M' command, to read back and load words in a single pass.
+	bool has_read_and_load() const {
+		return firmware_at_least(1, 9);
+	}
+
+	// For `count` consecutive words starting at the current address, request the word, load the next one
+	// of `data` into the write latch for that address, and go to the next address. Without waiting for the words.
+	// Returns the Reply of the first word; the others follow it. Leaves the address right after the last word.
+	Reply read_and_load_async(uint16_t const * data, size_t count) {
+		while (in_flight() && in_flight() + count > window) receive();
+		p.write('M');
+		write_value(count);
+		for (size_t i = 0; i < count; ++i) write_value(data[i]);
+		next_reply += count;
+		return next_reply - count;
+	}
+
+	// Wait for a requested reply.
+	// Replies must be collected in order: This discards all replies requested before `r`.
+	uint16_t get(Reply r) {
+		if (r < first_reply) throw std::logic_error("Reply was already collected.");
+		while (first_reply + received.size() <= r) receive();
+		received.erase(received.begin(), received.begin() + (r - first_reply));
+		uint16_t v = received.front();
+		received.pop_front();
+		first_reply = r + 1;
+		return v;
+	}
+
+	// Read `count` words starting at the current address, keeping up to `window` reads in flight.
+	// Calls f(i, value) for each of them, in order. Leaves the address right after the last word.
+	template<typename F>
+	void read_sequence(size_t count, F f) {
+		Reply first = next_reply;
+		size_t requested = 0;
+		// Request in blocks of about half the window, instead of topping it up one word at a time.
+		size_t chunk = has_blocks() ? std::max<size_t>(window / 2, 1) : 1;
+		for (size_t i = 0; i < count; ++i) {
+			while (requested < count && requested < i + window) {
+				size_t n = std::min(count - requested, i + window - requested);
+				if (n < chunk && requested + n < count) break;
+				read_block_async(n);
+				requested += n;
+			}
+			f(i, get(first + i));
+		}
+	}
+
+	// Whether the firmware supports the 'F' command, to set the ICSP clock rate.
+	bool has_clock_rate() const {
+		return firmware_at_least(1, 8);
+	}
+
+	// Set the ICSP clock rate, in kHz (at most 0x3FFF). By default, the programmer goes as fast as the target allows.
+	void set_clock_rate(unsigned int khz) {
+		if (!has_clock_rate()) throw std::runtime_error("Setting the ICSP clock rate needs programmer firmware 1.8 or newer.");
+		if (khz == 0 || khz > 0x3FFF) throw std::runtime_error("Invalid ICSP clock rate.");
+		p.write('F');
+		write_value(khz);
+	}
+
+	// Whether the firmware supports the 'p', 'x' and 'y' commands, which wait on the programmer itself.
+	bool has_timed_commands() const {
+		return firmware_at_least(1, 6);
+	}
+
+	// Program the row (or configuration word) at the current address, and wait the given time for it to finish.
+	void program_row(unsigned int microseconds) { timed('p', &Icsp::begin_programming, microseconds); }
+
+	// Like program_row(), but without waiting: The programmer waits before it executes the commands that follow.
+	// Needs has_timed_commands(), and at most 0x3FFF microseconds. The Reply is only there to be waited for.
+	Reply program_row_async(unsigned int microseconds) {
+		while (in_flight() >= window) receive();
+		p.write('p');
+		write_value(microseconds);
+		acks.push_back(next_reply);
+		return next_reply++;
+	}
+
+	// Bulk erase, and wait the given time for it to finish.
+	void erase(unsigned int microseconds) { timed('x', &Icsp::bulk_erase, microseconds); }
+
+	// Erase the row at the current address, and wait the given time for it to finish.
+	void erase_row(unsigned int microseconds) { timed('y', &Icsp::row_erase, microseconds); }
+
+	void begin() { p.write('B'); }
+	void end() { p.write('E'); }
+	void load_configuration(uint16_t v) { p.write('C'); write_value(v); }
+	void load_data(uint16_t v) { p.write('L'); write_value(v); }
+	uint16_t read_data() { return get(read_data_async()); }
+	void increment_address() { p.write('I'); }
+	void increment_address(size_t n) {
+		if (!firmware_at_least(1, 5)) {
+			for (size_t i = 0; i < n; ++i) increment_address();
+			return;
+		}
+		for (; n > 0x3FFF; n -= 0x3FFF) { p.write('J'); write_value(0x3FFF); }
+		if (n) { p.write('J'); write_value(n); }
+	}
+	void reset_address() { p.write('A'); }
+	void begin_programming() { p.write('P'); }
+	void begin_externally_timed_programming() { p.write('Q'); }
+	void end_externally_timed_programming() { p.write('S'); }
+	void bulk_erase() { p.write('X'); }
+	void row_erase() { p.write('Y'); }
+
+private:
+	// Let the programmer do the waiting, if it can. It replies when it's done.
+	// Otherwise, wait for the command to be started, and sleep here.
+	void timed(char command, void (Icsp::*untimed)(), unsigned int microseconds) {
+		if (has_timed_commands() && microseconds <= 0x3FFF) {
+			p.write(command);
+			write_value(microseconds);
+			drain();
+			p.flush();
+			if (p.read() != 'Y') throw std::runtime_error("Got invalid reply.");
+		} else {
+			(this->*untimed)();
+			test();
+			delay(microseconds);
+		}
+	}
+
+};
+
+// An image of program memory, the user id and the configuration words.
+//
+// It holds the largest program memory of any device (0x2000 words), whatever the target is.
+// Its rows are a fixed 32 word bookkeeping unit for tracking which parts are given and used,
+// which is not the same as the rows of a Device (16 words on some). Use used() with word
+// addresses to ask about the rows of a device, rather than indexing row_populated or row_used.
+struct MemoryDump {
+
+	static size_t const row_size = 32;
+	static size_t const rows = 0x2000 / row_size;
+
+	uint16_t memory[0x2000];
+	uint16_t user_id[4];
+	uint16_t revision_id;
+	uint16_t device_id;
+	uint16_t configuration[2];
+
+	size_t memory_used = 0;
+	bool user_id_set = false;
+	bool revision_id_set = false;
+	bool device_id_set = false;
+	bool configuration_set = false;
+
+	// Rows (of row_size words) of which at least one word is given in the hex file.
+	std::bitset<rows> row_populated;
+
+	// Rows of which at least one word is not 0x3FFF, the erased state.
+	// Only these need to be programmed after a bulk erase.
+	std::bitset<rows> row_used;
+
+	MemoryDump() {
+		std::fill(std::begin(memory), std::end(memory), 0x3FFF);
+		std::fill(std::begin(user_id), std::end(user_id), 0x3FFF);
+		std::fill(std::begin(configuration), std::end(configuration), 0x3FFF);
+		revision_id = device_id = 0;
+	}
+
+	// Whether any of the given words is not erased.
+	bool used(size_t a, size_t n) const {
+		for (size_t i = a; i < a + n && i < 0x2000; ++i) {
+			if (!row_used[i / row_size]) {
+				i = (i / row_size + 1) * row_size - 1;
+			} else if (memory[i] != 0x3FFF) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// 64-bit FNV-1a hash of what ends up on the chip: the program memory, the user id and the configuration words.
+	// (Words that are not given count as erased.) This can be compared with the same hash of a chip's contents.
+	static uint64_t hash(uint16_t const * memory, uint16_t const * user_id, uint16_t const * configuration);
+
+	uint64_t hash() const;
+
+	void update_row_used();
+
+	// Read an image from a stream, in large blocks.
+	// Both Intel HEX and compiled images (see save_image) are accepted.
+	void load(std::istream & in);
+	void load(char const * data, size_t size);
+
+	// Compiled images have a fixed layout, with all values in little endian:
+	//   0: "PICPIMG1"
+	//   8: Hash of the contents, as given by hash().
+	//  16: Flags: 1 = user id set, 2 = revision id set, 4 = device id set, 8 = configuration set.
+	//  18: Number of words of program memory used.
+	//  20: User id (4 words), revision id, device id, configuration (2 words).
+	//  36: Bitmap of populated rows, and of used rows (32 bytes each).
+	// 100: Program memory (0x2000 words).
+	// The hash only covers the contents, so load_image() checks that the rest of the header is consistent with them.
+	static char const image_magic[9];
+	static size_t const image_size = 100 + 0x2000 * 2;
+
+	void save_image(std::ostream & out) const;
+
+	void load_image(char const * data, size_t size);
+
+	// Parse Intel HEX formatted data.
+	// The length and checksum of every record is checked. Lines that don't start with ':' are ignored.
+	void load_ihex(char const * data, size_t size);
+
+	// Where load_ihex_lines() is, for parsing Intel HEX data in parts.
+	struct IhexState {
+		size_t address_offset = 0;
+		size_t line_number = 0;
+		bool ended = false; // The end of file record was seen. Everything after it is ignored.
+		size_t lowest = 0x2000; // The lowest address of program memory that was given, in the last call.
+	};
+
+	// Parse some more lines of Intel HEX data, like load_ihex(), but without updating row_used.
+	void load_ihex_lines(char const * data, size_t size, IhexState & state);
+
+};
+
+// An image that is still coming in, such that programming can start before all of it was read.
+// One thread gives it the data as it arrives, while another waits for rows that can't change anymore.
+// As long as the records are in order, a row is final as soon as something after it is given.
+// Once a record goes back to a row that was final already, the rest is buffered until the end instead.
+struct ImageStream {
+
+	// The final rows of the image, for the thread that called wait(). All of it, once `complete` is set.
+	MemoryDump image;
+
+	// Set by wait(), once all of the image was read.
+	bool complete = false;
+
+	// Set together with `complete`: the (MemoryDump) rows that were final before, but were changed by the rest of the image.
+	// (Records that go back can't be told apart from a gap in the image until they arrive.)
+	std::bitset<MemoryDump::rows> rewritten;
+
+	// Whether any of the given words is in a row of `rewritten`.
+	bool was_rewritten(size_t a, size_t n) const {
+		for (size_t r = a / MemoryDump::row_size; r * MemoryDump::row_size < a + n && r < MemoryDump::rows; ++r) {
+			if (rewritten[r]) return true;
+		}
+		return false;
+	}
+
+	// Parse the next part of the data. Both Intel HEX and compiled images are accepted,
+	// but a compiled image only becomes available when it's complete.
+	void feed(char const * data, size_t size);
+
+	// All data was given.
+	void finish();
+
+	// Reading the data failed. The error is thrown by wait().
+	void fail(std::exception_ptr e);
+
+	// Wait until more than `words` words are final, or until all of the image was read.
+	// Puts the final words in `image`, and returns how many there are.
+	// (Words become final a MemoryDump row at a time, so that's a multiple of MemoryDump::row_size.)
+	size_t wait(size_t words);
+
+private:
+	std::mutex mutex;
+	std::condition_variable changed;
+	MemoryDump parsed;
+	MemoryDump::IhexState state;
+	std::string pending; // The last (incomplete) line, or everything for a compiled image.
+	bool compiled = false;
+	bool in_order = true;
+	bool finished = false;
+	std::exception_ptr error;
+	size_t final_rows = 0;
+	size_t published = 0;
+
+};
+
+std::string hex_word(uint16_t v);
+
+// Writes Intel HEX records, formatted into one buffer that is written out in large blocks.
+struct IhexWriter {
+
+	std::ostream & out;
+	size_t record_size;
+
+	IhexWriter(std::ostream & out, size_t record_size) : out(out), record_size(record_size) {}
+
+	// Write 14-bit words, starting at the given word address.
+	void words(uint32_t address, uint16_t const * words, size_t count) {
+		uint32_t a = address * 2;
+		while (count) {
+			if (a >> 16 != upper) {
+				upper = a >> 16;
+				uint8_t data[2] = { uint8_t(upper >> 8), uint8_t(upper) };
+				record(0, 0x04, data, 2);
+			}
+			// Records are aligned to their size, so that they never cross a 64 KiB boundary.
+			size_t n = std::min(count, (record_size - a % record_size) / 2);
+			uint8_t data[256];
+			for (size_t i = 0; i < n; ++i) {
+				data[i * 2] = words[i] & 0xFF;
+				data[i * 2 + 1] = words[i] >> 8;
+			}
+			record(a & 0xFFFF, 0x00, data, n * 2);
+			a += n * 2;
+			words += n;
+			count -= n;
+		}
+	}
+
+	// Write the end of file record, and everything that's still buffered.
+	void end() {
+		record(0, 0x01, 0, 0);
+		flush();
+	}
+
+	void flush() {
+		out.write(buffer.data(), buffer.size());
+		out.flush();
+		if (!out) throw std::runtime_error("Unable to write output.");
+		buffer.clear();
+	}
+
+private:
+	std::string buffer;
+	uint32_t upper = 0; // The upper 16 bits of the address, as set by the last 0x04 record.
+
+	void record(uint16_t address, uint8_t type, uint8_t const * data, size_t size) {
+		static char const digits[] = "0123456789ABCDEF";
+		char line[1 + (4 + 255 + 1) * 2 + 1];
+		char * p = line;
+		uint8_t checksum = 0;
+		auto put = [&] (uint8_t b) {
+			*p++ = digits[b >> 4];
+			*p++ = digits[b & 0xF];
+			checksum += b;
+		};
+		*p++ = ':';
+		put(size);
+		put(address >> 8);
+		put(address & 0xFF);
+		put(type);
+		for (size_t i = 0; i < size; ++i) put(data[i]);
+		put(0x100 - checksum);
+		*p++ = '\n';
+		buffer.append(line, p);
+		if (buffer.size() >= 65536) flush();
+	}
+
+};
+
+// Thrown when an operation is stopped because Session::should_cancel returned true.
+struct Cancelled : std::runtime_error {
+	Cancelled() : std::runtime_error("Cancelled.") {}
+};
+
+// Everything that is done with a single programmer and its target.
+// All messages go to `log`, so that several sessions can run at once.
+// Operations that need the target connect() to it first, if that didn't happen yet.
+struct Session {
+
+	Icsp & d;
+	std::ostream & log;
+
+	// Called with the progress (done, total) of long operations, if set.
+	// When done reaches total, the operation (or that part of it) is complete.
+	std::function<void (size_t, size_t)> on_progress;
+
+	// Called regularly during long operations, if set.
+	// If it returns true, the operation is stopped by throwing Cancelled.
+	std::function<bool ()> should_cancel;
+
+	uint16_t revision_id = 0;
+	uint16_t device_id = 0;
+
+	// The connected chip, as found by connect().
+	Device const * device = 0;
+
+	// If set, the time spent in each phase is recorded here.
+	Phases * phases = 0;
+
+	// If set, program() keeps track of its progress here, for resume().
+	Journal * journal = 0;
+
+	void phase(char const * name) {
+		if (phases) phases->begin(name);
+	}
+
+	void progress(size_t done, size_t total) {
+		if (should_cancel && should_cancel()) throw Cancelled();
+		if (on_progress) on_progress(done, total);
+	}
+
+	void ensure_connected() {
+		if (!device) connect();
+	}
+
+	// The address can only be reset or moved forward, so keep track of where it is.
+	size_t address = 0;
+
+	Session(Icsp & d, std::ostream & log) : d(d), log(log) {}
+
+	// Reset the target, put it in programming mode, and identify it.
+	void connect();
+
+	// Check whether a target is present, by reading its device id like connect() does, but without
+	// waiting for a reset first. Leaves the target running again. Cheap enough to poll.
+	bool detect();
+
+	// Check the device and revision ID given in the image (if any) against the target,
+	// and check whether the image fits.
+	void check_image(MemoryDump const & m);
+
+	void reset_address() {
+		d.reset_address();
+		address = 0;
+	}
+
+	void go_to(size_t a) {
+		if (a > address) d.increment_address(a - address);
+		address = a;
+	}
+
+	// Compare program memory with an image, row by row. Returns which rows differ.
+	// The current contents of the differing rows are put in `current`.
+	// If `fast` is set, and the firmware supports it, only a checksum of the other rows is transferred.
+	std::vector<bool> compare_rows(MemoryDump const & m, bool fast, uint16_t * current);
+
+	// Compare the target with the image. Throws if anything differs.
+	void verify(MemoryDump const & m, bool fast);
+
+	// Program a user id or configuration word at the current address, verify it, and go to the next word.
+	void write_configuration_word(uint16_t value, char const * part);
+
+	// Program the image, and verify it.
+	// If `incremental` is set, only the rows that differ are erased and written, if possible.
+	void program(MemoryDump const & m, bool incremental);
+
+	// Program an image while it's still being read. The target is erased right away, and rows are
+	// written as soon as they are final. Rows that turn out to change afterwards are erased and written again.
+	// The user id is only erased if the image changes it.
+	// The device and revision id of the image are checked only at the end, before the configuration is written.
+	void program(ImageStream & stream);
+
+	// Continue an interrupted program(), using the journal. The last rows that were done are checked,
+	// and the rest is programmed without erasing. If there's nothing to resume, it does program(m, false).
+	void resume(MemoryDump const & m);
+
+	// Read `count` words of program memory, starting at `start`.
+	std::vector<uint16_t> read_program(size_t start, size_t count);
+
+	// Read all of configuration memory, starting at 0x8000.
+	std::vector<uint16_t> read_config();
+
+	// The hash of the contents of the target, the same as MemoryDump::hash() for an image that it holds.
+	uint64_t hash();
+
+	// Erase the program memory and the configuration words, and also the user id if `user_id` is set.
+	void erase(bool user_id);
+
+	// Leave programming mode, and let the target run.
+	void end();
+
+private:
+	// Enter programming mode and read the revision and device id. Returns whether a target answered.
+	bool identify();
+
+	// Program and verify the given rows of erased program memory, and then the configuration.
+	void write_erased(MemoryDump const & m, std::vector<bool> const & row_write);
+
+	// Program and verify the given rows of erased program memory, from row `first` on.
+	// Returns the number of words that were verified.
+	size_t write_rows(MemoryDump const & m, std::vector<bool> const & row_write, size_t first);
+
+	// Program the given rows of erased program memory, and verify each of them right after it was programmed,
+	// in a single pass. Needs Icsp::has_read_and_load(). Returns the number of words that were verified.
+	size_t program_and_verify_rows(MemoryDump const & m, std::vector<bool> const & row_write, size_t first);
+
+	// Program and verify the user id and configuration words of the image, after a bulk erase.
+	// If the bulk erase did not include the user id, its row is erased first, if necessary.
+	void write_config(MemoryDump const & m, bool user_id_erased);
+
+};
+
+// A programmer on a port, with a Session for its target. Opening it checks the version of the programmer.
+// Operations can be done one after the other, without reconnecting in between.
+struct Programmer {
+
+	Port port;
+	Icsp icsp;
+	Session session;
+	std::string version;
+
+	Programmer(char const * path, std::ostream & log) : port(path), icsp(port), session(icsp, log) {
+		version = icsp.version();
+	}
+
+};
@@ -4,17 +4,32 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <sys/select.h>
+#include <glob.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
 
 struct Port {
 
 private:
 	int fd;
 
+	std::vector<uint8_t> out;
+	std::vector<uint8_t> in;
+	size_t in_pos = 0;
+
 	Port(Port const &);
 	Port & operator = (Port const &);
 
 public:
 
+	PortStats stats;
+
+	// If set, everything that is sent and received is recorded here.
+	TraceWriter * trace = 0;
+
 	Port(char const * f) {
 		fd = open(f, O_RDWR);
 		if (fd < 0) throw std::runtime_error(std::string("Unable to open ") + f + ".");
@@ -26,13 +41,45 @@ public:
 		tty.c_cflag &= ~CSTOPB & ~CRTSCTS;
 		tty.c_cflag |= CLOCAL | CREAD;
 		if (tcsetattr(fd, TCSANOW, &tty) < 0) throw std::runtime_error(std::string("Error in tcsetattr: ") + strerror(errno));
+		// Throw away replies that an earlier interrupted run left behind.
+		tcflush(fd, TCIFLUSH);
 	}
 
 	void write(uint8_t b) {
-		if (::write(fd, &b, 1) < 0) throw std::runtime_error(std::string("Unable to write: ") + strerror(errno));
+		out.push_back(b);
+		if (out.size() >= 4096) flush();
+	}
+
+	void flush() {
+		size_t done = 0;
+		while (done < out.size()) {
+			ssize_t r = ::write(fd, out.data() + done, out.size() - done);
+			++stats.syscalls;
+			if (r < 0) {
+				if (errno == EINTR) continue;
+				throw std::runtime_error(std::string("Unable to write: ") + strerror(errno));
+			}
+			done += r;
+		}
+		stats.bytes_written += out.size();
+		if (trace && !out.empty()) trace->record('S', out.data(), out.size());
+		out.clear();
 	}
 
 	uint8_t read() {
+		if (in_pos == in.size()) fill();
+		return in[in_pos++];
+	}
+
+	~Port() {
+		try { flush(); } catch (...) {}
+		close(fd);
+	}
+
+private:
+	void fill() {
+		flush();
+		auto start = std::chrono::steady_clock::now();
 		{
 			timeval timeout;
 			timeout.tv_sec = 0;
@@ -41,27 +88,56 @@ public:
 			FD_ZERO(&fds);
 			FD_SET(fd, &fds);
 			int r = select(fd + 1, &fds, 0, 0, &timeout);
+			++stats.syscalls;
 			if (r < 0) throw std::runtime_error(std::string("Unable to read. select(): ") + strerror(errno));
 			if (r == 0) throw std::runtime_error("Unable to read: Timeout.");
 		}
 		{
-			uint8_t b;
-			ssize_t r = ::read(fd, &b, 1);
+			uint8_t buffer[4096];
+			ssize_t r = ::read(fd, buffer, sizeof(buffer));
+			++stats.syscalls;
 			if (r < 0) throw std::runtime_error(std::string("Unable to read: ") + strerror(errno));
-			if (r != 1) throw std::runtime_error("Unable to read a byte.");
-			usleep(1);
-			return b;
+			if (r == 0) throw std::runtime_error("Unable to read a byte.");
+			in.assign(buffer, buffer + r);
+			in_pos = 0;
+			stats.bytes_read += r;
+			if (trace) trace->record('R', buffer, r);
 		}
-	}
-
-	~Port() {
-		close(fd);
+		stats.round_trip(std::chrono::steady_clock::now() - start);
 	}
 
 };
 
-char const * default_port = "/dev/picp0";
+char const * const default_port = "/dev/picp0";
 
 inline bool is_port(char const * p) {
 	return p[0] == '/';
 }
+
+// All programmers that are connected (as named by the udev rule).
+inline std::vector<std::string> find_ports() {
+	std::vector<std::string> ports;
+	glob_t g;
+	if (glob("/dev/picp*", 0, 0, &g) == 0) {
+		ports.assign(g.gl_pathv, g.gl_pathv + g.gl_pathc);
+		globfree(&g);
+	}
+	return ports;
+}
+
+// Only Windows translates line endings on stdin.
+inline void binary_stdin() {}
+
+// Where the journals of `program` are kept: $XDG_CACHE_HOME/picp or ~/.cache/picp, created if needed.
+inline std::string journal_directory() {
+	std::string d;
+	char const * cache = getenv("XDG_CACHE_HOME");
+	char const * home = getenv("HOME");
+	if (cache && *cache) d = cache;
+	else if (home && *home) d = std::string(home) + "/.cache";
+	else return "";
+	mkdir(d.c_str(), 0755);
+	d += "/picp";
+	mkdir(d.c_str(), 0755);
+	return d;
+}
@@ -0,0 +1,116 @@
+// A Port that talks to an in-process Emulator, over a link with simulated latency.
+// Used by the benchmarks instead of linux.hpp.
+
+#include <thread>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "emulator.hpp"
+
+struct MockLink {
+
+	Emulator emulator;
+
+	// Time between sending data and the programmer receiving it, and the other way around.
+	// So every round trip costs twice this, on top of the time the programmer needs.
+	Clock::duration latency = std::chrono::microseconds(500);
+
+	size_t bytes_written = 0;
+	size_t bytes_read = 0;
+
+	// Times the host sent something and then had to wait for a reply.
+	// (Reading more replies that were already requested does not count again.)
+	size_t round_trips = 0;
+
+};
+
+MockLink mock_link;
+
+struct Port {
+
+private:
+	std::vector<uint8_t> out;
+	std::vector<uint8_t> in;
+	size_t in_pos = 0;
+	bool sent = false; // Whether anything was sent since the last fill().
+
+	Port(Port const &);
+	Port & operator = (Port const &);
+
+public:
+
+	PortStats stats;
+
+	// If set, everything that is sent and received is recorded here.
+	TraceWriter * trace = 0;
+
+	Port(char const *) {}
+
+	void write(uint8_t b) {
+		out.push_back(b);
+		if (out.size() >= 4096) flush();
+	}
+
+	void flush() {
+		auto arrival = Clock::now() + mock_link.latency;
+		for (uint8_t b : out) mock_link.emulator.receive(b, arrival);
+		if (!out.empty()) sent = true;
+		mock_link.bytes_written += out.size();
+		stats.bytes_written += out.size();
+		if (trace && !out.empty()) trace->record('S', out.data(), out.size());
+		out.clear();
+	}
+
+	uint8_t read() {
+		if (in_pos == in.size()) fill();
+		return in[in_pos++];
+	}
+
+private:
+	void fill() {
+		flush();
+		auto & output = mock_link.emulator.output;
+		if (output.empty()) throw std::runtime_error("Unable to read: Timeout.");
+		if (sent) ++mock_link.round_trips;
+		sent = false;
+		auto start = Clock::now();
+		auto now = start;
+		auto ready = output.front().first + mock_link.latency;
+		if (ready > now) {
+			std::this_thread::sleep_until(ready);
+			now = ready;
+		}
+		in.clear();
+		in_pos = 0;
+		while (!output.empty() && output.front().first + mock_link.latency <= now) {
+			in.push_back(output.front().second);
+			output.pop_front();
+		}
+		mock_link.bytes_read += in.size();
+		stats.bytes_read += in.size();
+		if (trace) trace->record('R', in.data(), in.size());
+		stats.round_trip(now - start);
+	}
+
+};
+
+char const * const default_port = "mock";
+
+inline bool is_port(char const * p) {
+	return p[0] == '/';
+}
+
+// There is only one emulated programmer.
+inline std::vector<std::string> find_ports() {
+	return std::vector<std::string>();
+}
+
+// Only Windows translates line endings on stdin.
+inline void binary_stdin() {}
+
+// Benchmarks don't keep journals.
+inline std::string journal_directory() {
+	return "";
+}
@@ -0,0 +1,146 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "devices.hpp"
+#include "emulator.hpp"
+
+volatile sig_atomic_t stop = 0;
+volatile sig_atomic_t swap_target = 0;
+
+void handle_signal(int) {
+	stop = 1;
+}
+
+void handle_swap(int) {
+	swap_target = 1;
+}
+
+std::chrono::microseconds microseconds(char const * s) {
+	return std::chrono::microseconds(strtoul(s, 0, 10));
+}
+
+int main(int argc, char * * argv) try {
+
+	Emulator e;
+	char const * link = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		char const * a = argv[i];
+		     if (!strncmp(a, "--byte-time=", 12)) e.byte_time = microseconds(a + 12);
+		else if (!strncmp(a, "--icsp-time=", 12)) e.icsp_time = microseconds(a + 12);
+		else if (!strncmp(a, "--program-time=", 15)) e.target.program_time = microseconds(a + 15);
+		else if (!strncmp(a, "--config-program-time=", 22)) e.target.configuration_program_time = microseconds(a + 22);
+		else if (!strncmp(a, "--erase-time=", 13)) e.target.bulk_erase_time = microseconds(a + 13);
+		else if (!strncmp(a, "--row-erase-time=", 17)) e.target.row_erase_time = microseconds(a + 17);
+		else if (!strncmp(a, "--device-id=", 12)) e.target.device_id = strtoul(a + 12, 0, 16);
+		else if (!strncmp(a, "--revision-id=", 14)) e.target.revision_id = strtoul(a + 14, 0, 16);
+		else if (!strcmp(a, "--no-target")) e.target.present = false;
+		else if (!strncmp(a, "--device=", 9) && find_device(a + 9)) {
+			Device const & d = *find_device(a + 9);
+			e.target.device_id = d.device_id;
+			e.target.program_size = d.program_size;
+			e.target.row_size = d.row_size;
+			e.target.program_time = std::chrono::microseconds(d.program_time);
+			e.target.configuration_program_time = std::chrono::microseconds(d.configuration_program_time);
+			e.target.bulk_erase_time = std::chrono::microseconds(d.bulk_erase_time);
+			e.target.row_erase_time = std::chrono::microseconds(d.row_erase_time);
+		}
+		else if (!strncmp(a, "--firmware=", 11)) e.version = std::string("PIC16F145x programmer ") + (a + 11) + " (emulated)\n";
+		else if (a[0] != '-' && !link) link = a;
+		else {
+			std::clog << "Usage: " << argv[0] << " [options] [link]\n";
+			std::clog << "\tEmulate a programmer with a PIC16F145x attached, on a pseudo terminal.\n";
+			std::clog << "\tThe path of the pseudo terminal is printed, and symlinked from link if given.\n\n";
+			std::clog << "Options (times in microseconds, ids in hexadecimal):\n";
+			std::clog << "\t--byte-time=0 --icsp-time=0\n";
+			std::clog << "\t--program-time=2500 --config-program-time=5000 --erase-time=5000 --row-erase-time=2500\n";
+			std::clog << "\t--device-id=3020 --revision-id=2003 --no-target\n";
+			std::clog << "\t--device=PIC16F1454 (sets the device id, memory layout and timing of any device known to picp)\n";
+			std::clog << "\t--firmware=1.10 (the version to report, to test older protocol versions)\n\n";
+			std::clog << "Send SIGUSR1 to remove the target, and again to put in a new, blank one.\n";
+			return 1;
+		}
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) throw std::runtime_error(std::string("Unable to create pseudo terminal: ") + strerror(errno));
+	std::string slave_name = ptsname(master);
+
+	// Keep the slave side open ourselves, so the master doesn't get hung up on
+	// every time picp closes it.
+	int slave = open(slave_name.c_str(), O_RDWR | O_NOCTTY);
+	if (slave < 0) throw std::runtime_error("Unable to open " + slave_name + ".");
+	termios tty;
+	tcgetattr(slave, &tty);
+	cfmakeraw(&tty);
+	tcsetattr(slave, TCSANOW, &tty);
+
+	if (link) {
+		unlink(link);
+		if (symlink(slave_name.c_str(), link) < 0) throw std::runtime_error(std::string("Unable to create ") + link + ": " + strerror(errno));
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+	signal(SIGUSR1, handle_swap);
+
+	std::cout << (link ? link : slave_name) << std::endl;
+
+	while (!stop) {
+		if (swap_target) {
+			swap_target = 0;
+			e.target.present = !e.target.present;
+			if (e.target.present) e.target.blank();
+			std::clog << (e.target.present ? "Target inserted." : "Target removed.") << std::endl;
+		}
+
+		auto now = Clock::now();
+
+		std::string ready;
+		while (!e.output.empty() && e.output.front().first <= now) {
+			ready += e.output.front().second;
+			e.output.pop_front();
+		}
+		if (!ready.empty() && write(master, ready.data(), ready.size()) < 0) throw std::runtime_error(std::string("Unable to write: ") + strerror(errno));
+
+		int timeout = 100;
+		if (!e.output.empty()) {
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(e.output.front().first - now).count() + 1;
+		}
+		pollfd p = { master, POLLIN, 0 };
+		int r = poll(&p, 1, timeout);
+		if (r < 0 && errno != EINTR) throw std::runtime_error(std::string("Unable to poll: ") + strerror(errno));
+		if (r > 0) {
+			uint8_t buffer[4096];
+			ssize_t n = read(master, buffer, sizeof(buffer));
+			if (n < 0) throw std::runtime_error(std::string("Unable to read: ") + strerror(errno));
+			now = Clock::now();
+			for (ssize_t i = 0; i < n; ++i) e.receive(buffer[i], now);
+		}
+
+		static size_t reported_violations = 0;
+		if (e.target.timing_violations != reported_violations) {
+			std::clog << "Warning: " << e.target.timing_violations - reported_violations << " command(s) ignored because the target was still busy." << std::endl;
+			reported_violations = e.target.timing_violations;
+		}
+	}
+
+	if (link) unlink(link);
+	close(slave);
+	close(master);
+
+} catch (std::exception & e) {
+	std::clog << e.what() << std::endl;
+	return 1;
+}
@@ -1,190 +1,256 @@
-#include <iostream>
+#include <fstream>
 #include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
-#include <stdexcept>
+#include <thread>
+#include <vector>
 
+#include <signal.h>
 #include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
+#include <string.h>
 
-#ifdef _WIN32
-#include "windows.hpp"
-#else
-#include "linux.hpp"
-#endif
+#include "libpicp.hpp"
 
-struct Icsp {
+// Show a progress bar. Updates are shown at most every 50 ms, except for the final one,
+// which also ends the line.
+void print_progress(size_t now, size_t limit) {
+	static std::chrono::steady_clock::time_point last_update;
+	auto t = std::chrono::steady_clock::now();
+	if (now < limit && t - last_update < std::chrono::milliseconds(50)) return;
+	last_update = t;
+	std::stringstream s;
+	s << "\r[";
+	size_t x = now * 72 / limit;
+	for (size_t i = 0; i < x; ++i) s << '=';
+	if (x != 72) { s << '>'; ++x; }
+	for (; x < 72; ++x) s << ' ';
+	s << "] " << (now * 100 / limit) << '%';
+	if (now >= limit) s << '\n';
+	std::cerr << s.str();
+}
 
-	Port & p;
+volatile sig_atomic_t interrupted = 0;
 
-	Icsp(Port & p) : p(p) {
-		p.write(' ');
-	}
+void interrupt(int) {
+	interrupted = 1;
+}
 
-	std::string version() {
-		p.write('V');
-		std::string version;
-		while (true) {
-			char c = p.read();
-			if (c == '\n') break;
-			version += c;
+// Program every target that is connected, one after the other, until interrupted (with Ctrl-C).
+// Polls for a target, less often the longer there is none, and programs it as soon as it's found.
+// The next target is programmed only after this one was removed. Returns the number of failed targets.
+size_t watch(Session & s, MemoryDump const & m) {
+	signal(SIGINT, interrupt);
+	s.should_cancel = [] { return interrupted != 0; };
+	size_t programmed = 0;
+	size_t failed = 0;
+	std::clog << "Waiting for a target. Press Ctrl-C to stop." << std::endl;
+	unsigned int interval = 20000;
+	while (!interrupted) {
+		if (!s.detect()) {
+			s.d.delay(interval);
+			interval = std::min(interval * 2, 500000u);
+			continue;
 		}
-		return version;
-	}
-
-	void write_value(uint16_t value) {
-		p.write(0x80 | (value >> 7));
-		p.write(0x80 | (value & 0x7F));
-	}
-
-	void test() {
-		p.write('T');
-		if (p.read() != 'Y') throw std::runtime_error("Got invalid reply.");
+		interval = 20000;
+		size_t n = programmed + failed + 1;
+		auto start = std::chrono::steady_clock::now();
+		try {
+			s.connect();
+			s.check_image(m);
+			s.program(m, false);
+			s.end();
+			++programmed;
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::clog << "Target " << n << ": OK (" << std::fixed << std::setprecision(2) << seconds << " s)." << std::endl;
+		} catch (Cancelled &) {
+			s.end();
+			std::clog << "Target " << n << ": interrupted." << std::endl;
+			break;
+		} catch (std::exception & e) {
+			s.end();
+			++failed;
+			std::clog << "Target " << n << ": FAILED: " << e.what() << std::endl;
+		}
+		std::clog << "Waiting for the target to be removed..." << std::endl;
+		while (!interrupted && s.detect()) s.d.delay(200000);
+		if (!interrupted) std::clog << "Waiting for the next target..." << std::endl;
 	}
+	s.should_cancel = nullptr;
+	signal(SIGINT, SIG_DFL);
+	std::clog << programmed << " programmed, " << failed << " failed." << std::endl;
+	return failed;
+}
 
-	uint16_t read_value() {
-		uint8_t a = p.read();
-		uint8_t b = p.read();
-		if (!(a & b & 0x80)) throw std::runtime_error("Invalid data received.");
-		return (a & 0x7F) << 7 | (b & 0x7F);
+// Program the same image to several targets at once, with a thread per programmer.
+// A failing target doesn't affect the others. Returns the number of failed targets.
+size_t gang(MemoryDump const & m, std::vector<std::string> const & ports, bool incremental) {
+	std::mutex mutex;
+	size_t failed = 0;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (auto & port : ports) {
+		threads.emplace_back([&, port] {
+			std::stringstream log;
+			bool ok = false;
+			auto start = std::chrono::steady_clock::now();
+			try {
+				Port p(port.c_str());
+				Icsp d(p);
+				log << d.version() << std::endl;
+				Session s(d, log);
+				s.connect();
+				s.check_image(m);
+				s.program(m, incremental);
+				s.end();
+				ok = true;
+			} catch (std::exception & e) {
+				log << e.what() << std::endl;
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::lock_guard<std::mutex> lock(mutex);
+			std::stringstream s;
+			s << std::fixed << std::setprecision(2) << seconds << " s";
+			if (ok) {
+				std::clog << port << ": OK (" << s.str() << ")" << std::endl;
+			} else {
+				++failed;
+				std::clog << port << ": FAILED (" << s.str() << ")" << std::endl;
+				std::string line;
+				while (std::getline(log, line)) std::clog << "\t" << line << std::endl;
+			}
+		});
 	}
-
-	void begin() { p.write('B'); }
-	void end() { p.write('E'); }
-	void load_configuration(uint16_t v) { p.write('C'); write_value(v); }
-	void load_data(uint16_t v) { p.write('L'); write_value(v); }
-	uint16_t read_data() { p.write('R'); return read_value(); }
-	void increment_address() { p.write('I'); }
-	void reset_address() { p.write('A'); }
-	void begin_programming() { p.write('P'); }
-	void begin_externally_timed_programming() { p.write('Q'); }
-	void end_externally_timed_programming() { p.write('S'); }
-	void bulk_erase() { p.write('X'); }
-	void row_erase() { p.write('Y'); }
-
-};
-
-uint8_t hex_value(char c) {
-	if (c >= '0' && c <= '9') return c - '0';
-	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-	throw std::runtime_error(std::string("Not a valid hexadecimal digit: '") + c + "'.");
+	for (auto & t : threads) t.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	size_t words = m.memory_used * (ports.size() - failed);
+	std::stringstream s;
+	s << std::fixed << std::setprecision(2) << seconds << " s (" << std::setprecision(0) << words / seconds << " words/s in total)";
+	std::clog << "Programmed " << ports.size() - failed << " of " << ports.size() << " targets in " << s.str() << "." << std::endl;
+	return failed;
 }
 
-uint8_t hex_byte(std::string & s, size_t i = 0) {
-	if (i + 1 >= s.size() || s[i+1] == '\n') throw std::runtime_error("Unexpected end of line.");
-	return hex_value(s[i]) << 4 | hex_value(s[i+1]);
+// Read an image from stdin in a thread of its own, line by line, such that it can be programmed while it comes in.
+// The thread is detached: when programming fails, there is no need to wait for the rest of the input.
+std::shared_ptr<ImageStream> stream_stdin() {
+	std::shared_ptr<ImageStream> stream(new ImageStream);
+	std::thread([stream] {
+		try {
+			std::string line;
+			while (std::getline(std::cin, line)) {
+				// (Only the last line can end without a newline.)
+				if (!std::cin.eof()) line += '\n';
+				stream->feed(line.data(), line.size());
+			}
+			if (std::cin.bad()) throw std::runtime_error("Unable to read the image.");
+			stream->finish();
+		} catch (...) {
+			stream->fail(std::current_exception());
+		}
+	}).detach();
+	return stream;
 }
 
-struct MemoryDump {
+// Prints the statistics of a command when it's done (or failed), for --stats.
+struct StatsReport {
 
-	uint16_t memory[0x2000];
-	uint16_t user_id[4];
-	uint16_t revision_id;
-	uint16_t device_id;
-	uint16_t configuration[2];
-
-	size_t memory_used = 0;
-	bool user_id_set = false;
-	bool revision_id_set = false;
-	bool device_id_set = false;
-	bool configuration_set = false;
-
-	MemoryDump() {
-		std::fill(std::begin(memory), std::end(memory), 0x3FFF);
-	}
-
-	void load_ihex(std::istream & in) {
-		std::string line;
-		size_t address_offset = 0;
-		while (std::getline(in, line)) {
-			if (line[0] != ':') continue;
-			size_t size = hex_byte(line, 1);
-			size_t address = hex_byte(line, 3) << 8 | hex_byte(line, 5);
-			uint8_t type = hex_byte(line, 7);
-			if (type == 0x00) {
-				if (size % 2 != 0 || address % 2 != 0) throw std::runtime_error("Only data records with an even number of bytes on even addresses are supported.");
-				for (size_t i = 0; i < size / 2; ++i) {
-					size_t a = (address_offset + address) / 2 + i;
-					uint16_t value = hex_byte(line, 9 + i * 4 + 2) << 8 | hex_byte(line, 9 + i * 4);
-					value &= 0x3FFF;
-					if (a < 0x2000) {
-						memory[a] = value;
-						memory_used = std::max(a + 1, memory_used);
-					} else if (a >= 0x8000 && a < 0x8004) {
-						user_id[a - 0x8000] = value;
-						user_id_set = true;
-					} else if (a == 0x8005) {
-						revision_id = value;
-						revision_id_set = true;
-					} else if (a == 0x8006) {
-						device_id = value;
-						device_id_set = true;
-					} else if (a >= 0x8007 && a < 0x8009) {
-						configuration[a - 0x8007] = value;
-						configuration_set = true;
-					} else if (a >= 0x8000 && a <= 0x800A) {
-						// ignore
-					} else {
-						std::stringstream s;
-						s << "Got data for invalid address " << std::hex << a << ".";
-						throw std::runtime_error(s.str());
-					}
-				}
-			} else if (type == 0x01) {
-				break;
-			} else if (type == 0x02 && size == 2) {
-				address_offset = hex_byte(line, 9) << 12 | hex_byte(line, 11) << 4;
-			} else if (type == 0x04 && size == 2) {
-				address_offset = hex_byte(line, 9) << 24 | hex_byte(line, 11) << 16;
-			} else {
-				std::stringstream s;
-				s << "Unknown record type 0x" << std::hex << type << " (size " << std::dec << size << ").";
-				throw std::runtime_error(s.str());
+	char const * format; // "text" or "json".
+	std::string command;
+	Phases & phases;
+	PortStats const & port;
+	Icsp const & icsp;
+	std::chrono::steady_clock::time_point start;
+
+	~StatsReport() {
+		phases.end();
+		bool ok = !std::uncaught_exception();
+		double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::stringstream s;
+		s << std::fixed << std::setprecision(6);
+		if (!strcmp(format, "json")) {
+			s << "{\"command\": \"" << command << "\", \"ok\": " << (ok ? "true" : "false");
+			s << ", \"seconds\": " << total << ", \"phases\": {";
+			for (size_t i = 0; i < phases.times.size(); ++i) {
+				s << (i ? ", " : "") << '"' << phases.times[i].first << "\": " << phases.times[i].second;
+			}
+			s << "}, \"bytes_written\": " << port.bytes_written << ", \"bytes_read\": " << port.bytes_read;
+			s << ", \"syscalls\": " << port.syscalls << ", \"round_trips\": " << port.round_trips;
+			s << ", \"wait_seconds\": " << port.wait_time << ", \"sleep_seconds\": " << icsp.sleep_time;
+			s << ", \"latency_histogram_us\": {";
+			bool first = true;
+			for (size_t i = 0; i < PortStats::latency_buckets; ++i) {
+				if (!port.latency[i]) continue;
+				s << (first ? "" : ", ") << "\"" << (i ? 1 << i : 0) << "\": " << port.latency[i];
+				first = false;
+			}
+			s << "}}\n";
+		} else {
+			s << std::setprecision(3);
+			s << "Statistics (" << (ok ? "succeeded" : "failed") << "):\n";
+			for (auto & p : phases.times) s << '\t' << std::left << std::setw(10) << p.first << std::right << std::setw(9) << p.second << " s\n";
+			s << '\t' << std::left << std::setw(10) << "total" << std::right << std::setw(9) << total << " s\n";
+			s << "\t" << port.bytes_written << " bytes written, " << port.bytes_read << " bytes read, " << port.syscalls << " system calls.\n";
+			s << "\t" << port.round_trips << " round trips, waiting " << port.wait_time << " s for the programmer.\n";
+			s << "\t" << icsp.sleep_time << " s sleeping.\n";
+			s << "\tRound trip latency:\n";
+			for (size_t i = 0; i < PortStats::latency_buckets; ++i) {
+				if (!port.latency[i]) continue;
+				s << "\t\t" << std::setw(8) << (i ? 1 << i : 0) << " us and up: " << port.latency[i] << "\n";
 			}
 		}
+		std::cerr << s.str();
 	}
 
-
 };
 
-void print_progress(unsigned int now, unsigned int limit) {
-	std::stringstream s;
-	s << "\r[";
-	size_t x = now * 72 / limit;
-	for (size_t i = 0; i < x; ++i) s << '=';
-	if (x != 72) { s << '>'; ++x; }
-	for (; x < 72; ++x) s << ' ';
-	s << "] " << (now * 100 / limit) << '%';
-	std::cerr << s.str();
-}
-
-std::string hex_word(uint16_t v) {
-	std::stringstream s;
-	s << std::hex << std::setfill('0') << std::setw(4) << v;
-	return s.str();
-}
-
-void verify_failure(char const * part, uint16_t good, uint16_t bad) {
-	std::stringstream s;
-	s << "Verification failure in " << part << ": ";
-	s << "0x" << hex_word(good) << " was written, but ";
-	s << "0x" << hex_word(bad) << " was read.";
-	throw std::runtime_error(s.str());
-}
-
 int main(int argc, char * * argv) try {
 
+	auto start = std::chrono::steady_clock::now();
+
+	// --stats, --trace and --clock may be given anywhere.
+	char const * stats = 0;
+	char const * trace = 0;
+	unsigned int clock_rate = 0;
+	{
+		int n = 1;
+		for (int i = 1; i < argc; ++i) {
+			if (!strcmp(argv[i], "--stats")) stats = "text";
+			else if (!strncmp(argv[i], "--stats=", 8)) stats = argv[i] + 8;
+			else if (!strncmp(argv[i], "--trace=", 8)) trace = argv[i] + 8;
+			else if (!strcmp(argv[i], "--trace") && i + 1 < argc) trace = argv[++i];
+			else if (!strncmp(argv[i], "--clock=", 8)) {
+				char * e;
+				unsigned long khz = strtoul(argv[i] + 8, &e, 10);
+				if (!argv[i][8] || *e || khz == 0 || khz > 0x3FFF) throw std::runtime_error(std::string("Invalid clock rate: ") + (argv[i] + 8) + ".");
+				clock_rate = khz;
+			}
+			else argv[n++] = argv[i];
+		}
+		argc = n;
+		argv[argc] = 0;
+	}
+	if (stats && strcmp(stats, "text") && strcmp(stats, "json")) throw std::runtime_error(std::string("Unknown statistics format: ") + stats + ".");
+
 	if (argc <= 1) {
 		std::clog << "Usage: \n";
 		std::clog << '\t' << argv[0] << " " << default_port << "\n";
 		std::clog << '\t' << argv[0] << " [" << default_port << "] check\n\t\tCheck connection with programmer.\n\n";
 		std::clog << '\t' << argv[0] << " [" << default_port << "] reset\n\t\tReset target.\n\n";
 		std::clog << '\t' << argv[0] << " [" << default_port << "] config\n\t\tShow the configuration words.\n\n";
-		std::clog << '\t' << argv[0] << " [" << default_port << "] dump [> file]\n\t\tRead the program and configuration memory, and dump it in Intel HEX format.\n\n";
-		std::clog << '\t' << argv[0] << " [" << default_port << "] program [< file]\n\t\tFlash the given program (and optionally, configuration and user id words) (in Intel HEX format) to the connected chip.\n\n";
+		std::clog << '\t' << argv[0] << " [" << default_port << "] dump [--range=start-end] [--trim] [--record-size=16|32] [> file]\n\t\tRead the program and configuration memory, and dump it in Intel HEX format.\n\t\tThe range is given in (hexadecimal) word addresses, and includes the end. Configuration memory starts at 8000.\n\t\tWith --trim, erased words at the end of program memory are left out.\n\n";
+		std::clog << '\t' << argv[0] << " [" << default_port << "] program [--incremental|--resume|--stream] [< file]\n\t\tFlash the given program (and optionally, configuration and user id words) (in Intel HEX format) to the connected chip.\n\t\tWith --incremental, only the rows that differ are erased and written.\n\t\tWith --resume, continue where an interrupted program of the same file on the same target stopped.\n\t\tWith --stream, start erasing and writing while the file is still being read (e.g. from a pipe).\n\t\tThe device and revision id in the file are then only checked after the chip was erased.\n\n";
+		std::clog << '\t' << argv[0] << " [" << default_port << "] verify [--fast] [< file]\n\t\tCompare the program memory (and configuration and user id words, if given) with the given program (in Intel HEX format).\n\t\tWith --fast, only checksums are read back, except for the rows that differ.\n\n";
+		std::clog << '\t' << argv[0] << " [" << default_port << "] watch file\n\t\tProgram every target that is connected, one after the other, until Ctrl-C is pressed.\n\t\tThe next target is programmed as soon as it is found, after the previous one was removed.\n\n";
+		std::clog << '\t' << argv[0] << " gang [--incremental] file [port...]\n\t\tProgram the given program (in Intel HEX format, or a compiled image) to the chips on all given ports (or all that are found) at once.\n\n";
+		std::clog << '\t' << argv[0] << " compile in.hex out.picimg\n\t\tCompile an Intel HEX file to a binary image, which is loaded faster. Images can be used everywhere Intel HEX is accepted.\n\n";
+		std::clog << '\t' << argv[0] << " hash [file]\n\t\tShow the hash of the contents of an image (or Intel HEX file). Words that are not given count as erased.\n\n";
+		std::clog << '\t' << argv[0] << " [" << default_port << "] hash --target\n\t\tShow the same hash of the contents of the connected chip, to see if it holds exactly a given image.\n\n";
 		std::clog << '\t' << argv[0] << " [" << default_port << "] erase\n\t\tErase the program and configuration memory, excluding the four user id words.\n\n";
 		std::clog << '\t' << argv[0] << " [" << default_port << "] eraseall\n\t\tErase the program and configuration memory, including the four user id words.\n\n";
+		std::clog << "Add --trace=file to any command to record everything that goes over USB, for picp-replay.\n";
+		std::clog << "Add --clock=kHz to any command that connects to a programmer to slow down the ICSP clock (for long wires). (Needs firmware 1.8.)\n";
+		std::clog << "Add --stats or --stats=json to any command that connects to a programmer to print where the time went, and what went over USB.\n\n";
 		return 1;
 	}
 
@@ -201,51 +267,83 @@ int main(int argc, char * * argv) try {
 		if (argv[1]) command = argv[1];
 		n_args = argc - 2;
 	}
+	std::vector<std::string> args(argv + argc - n_args, argv + argc);
+
+	binary_stdin();
 
+	if (command == "compile" && n_args == 2) {
+		MemoryDump m;
+		std::ifstream in(args[0], std::ios::binary);
+		if (!in) throw std::runtime_error("Unable to open " + args[0] + ".");
+		m.load(in);
+		std::ofstream out(args[1], std::ios::binary);
+		m.save_image(out);
+		out.close();
+		if (!out) throw std::runtime_error("Unable to write " + args[1] + ".");
+		std::clog << "Wrote " << args[1] << " (" << m.memory_used << " words, hash " << std::hex << std::setfill('0') << std::setw(16) << m.hash() << ")." << std::endl;
+		return 0;
+	}
+
+	if (command == "hash" && (n_args == 0 || (n_args == 1 && args[0] != "--target"))) {
+		MemoryDump m;
+		if (n_args == 1) {
+			std::ifstream in(args[0], std::ios::binary);
+			if (!in) throw std::runtime_error("Unable to open " + args[0] + ".");
+			m.load(in);
+		} else {
+			m.load(std::cin);
+		}
+		std::cout << std::hex << std::setfill('0') << std::setw(16) << m.hash() << std::endl;
+		return 0;
+	}
+
+	if (command == "gang" && n_args >= 1) {
+		if (stats || trace || clock_rate) throw std::runtime_error("--stats, --trace and --clock can not be used with gang.");
+		bool incremental = args[0] == "--incremental";
+		if (incremental) args.erase(args.begin());
+		if (args.empty()) throw std::runtime_error("No file given.");
+		std::vector<std::string> ports(args.begin() + 1, args.end());
+		if (ports.empty()) ports = find_ports();
+		if (ports.empty()) throw std::runtime_error("No programmers found.");
+		MemoryDump m;
+		std::clog << "Reading image..." << std::endl;
+		std::ifstream file(args[0], std::ios::binary);
+		if (!file) throw std::runtime_error("Unable to open " + args[0] + ".");
+		m.load(file);
+		std::clog << "Programming " << ports.size() << " targets..." << std::endl;
+		return gang(m, ports, incremental) ? 1 : 0;
+	}
+
+	// (Declared before the Port, since the Port still writes to it when it's destroyed.)
+	std::unique_ptr<TraceWriter> trace_writer;
+	if (trace) trace_writer.reset(new TraceWriter(trace));
+
+	Phases phases;
+	phases.begin("open");
 	Port p(dev);
+	p.trace = trace_writer.get();
 	Icsp d(p);
+	std::unique_ptr<StatsReport> report;
+	if (stats) report.reset(new StatsReport{stats, command, phases, p.stats, d, start});
 
+	phases.begin("version");
 	std::clog << d.version() << std::endl;
 	std::clog << "Connected to programmer." << std::endl;
+	if (clock_rate) d.set_clock_rate(clock_rate);
 
-	uint16_t revision_id = 0;
-	uint16_t device_id = 0;
-
-	auto connect = [&] {
-		std::clog << "Resetting target..." << std::endl;
-		d.end();
-		usleep(250000);
-		d.begin();
-
-		d.load_configuration(0);
-		for (size_t i = 0; i < 5; ++i) d.increment_address();
-		revision_id = d.read_data();
-		d.increment_address();
-		device_id = d.read_data();
-		{
-			std::string device_name = "unknown device";
-			if      (device_id == 0x3020) device_name = "PIC16F1454";
-			else if (device_id == 0x3024) device_name = "PIC16LF1454";
-			else if (device_id == 0x3021) device_name = "PIC16F1455";
-			else if (device_id == 0x3025) device_name = "PIC16LF1455";
-			else if (device_id == 0x3023) device_name = "PIC16F1459";
-			else if (device_id == 0x3027) device_name = "PIC16LF1459";
-			else if (device_id == 0x3FFF || device_id == 0) throw std::runtime_error("No target found.");
-			std::clog << "Connected to " << device_name << "." << std::endl;
-		}
-	};
-
-	bool showprogress = isatty(fileno(stderr));
+	Session s(d, std::clog);
+	s.phases = &phases;
+	if (isatty(fileno(stderr))) s.on_progress = print_progress;
 
 	if (n_args == 0 && (command == "" || command == "check")) {
 		return 0;
 
 	} else if (n_args == 0 && command == "reset") {
-		connect();
+		s.connect();
 
 	} else if (n_args == 0 && command == "config") {
-		connect();
-		d.load_configuration(0);
+		s.connect();
+		s.phase("read");
 		char const *names[] = {
 			"User ID 0", "User ID 1", "User ID 2", "User ID 3",
 			"Reserved",
@@ -253,143 +351,106 @@ int main(int argc, char * * argv) try {
 			"Configuration Word 1", "Configuration Word 2",
 			"Calibration Word 1", "Calibration Word 2"
 		};
-		for (unsigned int i = 0; i < 11; ++i) {
-			uint16_t r = d.read_data();
-			printf("%04X: 0x%04X\t%s \n", 0x8000 + i, r, names[i]);
-			d.increment_address();
+		if (s.device->device_id_mask != 0x3FFF) names[5] = "Reserved";
+		std::vector<uint16_t> configuration = s.read_config();
+		for (size_t i = 0; i < configuration.size(); ++i) {
+			printf("%04X: 0x%04X\t%s \n", unsigned(0x8000 + i), configuration[i], names[i]);
 		}
 
-	} else if (n_args == 0 && command == "dump") {
-		connect();
-		showprogress &= !isatty(fileno(stdout));
-		std::clog << "Downloading program memory..." << std::endl;
-		d.reset_address();
-		for (unsigned int a = 0; a <= 0x3FFE; a += 2) {
-			uint16_t v = d.read_data();
-			d.increment_address();
-			uint8_t checksum = 0x100 - 0x02 - (a & 0xFF) - (a >> 8) - (v & 0xFF) - (v >> 8);
-			printf(":02%04X00%02X%02X%02X\n", a, v & 0xFF, v >> 8, checksum);
-			if (showprogress) print_progress(a, 0x3FFE);
+	} else if (command == "dump") {
+		uint32_t start = 0;
+		uint32_t end = 0x800A;
+		bool trim = false;
+		size_t record_size = 16;
+		for (auto & a : args) {
+			if (a.compare(0, 8, "--range=") == 0) {
+				char * e;
+				start = strtoul(a.c_str() + 8, &e, 16);
+				if (*e != '-') throw std::runtime_error("Invalid range: " + a.substr(8) + ".");
+				end = strtoul(e + 1, &e, 16);
+				if (*e || end < start) throw std::runtime_error("Invalid range: " + a.substr(8) + ".");
+			} else if (a == "--trim") {
+				trim = true;
+			} else if (a == "--record-size=16" || a == "--record-size=32") {
+				record_size = a[14] == '1' ? 16 : 32;
+			} else {
+				throw std::runtime_error("Unknown option for dump: " + a + ".");
+			}
+		}
+		s.connect();
+		s.phase("read");
+		if (isatty(fileno(stdout))) s.on_progress = nullptr;
+		IhexWriter out(std::cout, record_size);
+		if (start < s.device->program_size) {
+			uint32_t program_end = std::min<uint32_t>(end + 1, s.device->program_size);
+			std::clog << "Downloading program memory..." << std::endl;
+			std::vector<uint16_t> memory = s.read_program(start, program_end - start);
+			size_t n = memory.size();
+			if (trim) while (n && memory[n - 1] == 0x3FFF) --n;
+			out.words(start, memory.data(), n);
 		}
-		if (showprogress) std::clog << std::endl;
-		std::clog << "Downloading configuration..." << std::endl;
-		printf(":020000040001F9\n");
-		d.load_configuration(0);
-		for (unsigned int a = 0; a <= 20; a += 2) {
-			uint16_t v = d.read_data();
-			d.increment_address();
-			uint8_t checksum = 0x100 - 0x02 - (a & 0xFF) - (a >> 8) - (v & 0xFF) - (v >> 8);
-			printf(":02%04X00%02X%02X%02X\n", a, v & 0xFF, v >> 8, checksum);
-			if (showprogress) print_progress(a, 20);
+		if (end >= 0x8000 && start < 0x8000 + s.device->configuration_size) {
+			uint32_t first = std::max<uint32_t>(start, 0x8000) - 0x8000;
+			uint32_t last = std::min<uint32_t>(end - 0x8000, s.device->configuration_size - 1);
+			std::clog << "Downloading configuration..." << std::endl;
+			std::vector<uint16_t> configuration = s.read_config();
+			out.words(0x8000 + first, &configuration[first], last + 1 - first);
 		}
-		if (showprogress) std::clog << std::endl;
-		printf(":00000001FF\n");
+		out.end();
 		std::clog << "Done." << std::endl;
 
-	} else if (n_args == 0 && command == "erase") {
-		connect();
-		std::clog << "Erasing..." << std::endl;
-		d.reset_address();
-		d.bulk_erase();
-		usleep(5000);
-		d.test();
-		std::clog << "Done." << std::endl;
+	} else if (n_args == 1 && command == "hash" && args[0] == "--target") {
+		s.connect();
+		s.phase("read");
+		std::clog << "Reading program memory and configuration..." << std::endl;
+		std::cout << std::hex << std::setfill('0') << std::setw(16) << s.hash() << std::endl;
 
-	} else if (n_args == 0 && command == "eraseall") {
-		connect();
+	} else if (n_args == 0 && (command == "erase" || command == "eraseall")) {
+		s.connect();
+		s.phase("erase");
 		std::clog << "Erasing..." << std::endl;
-		d.load_configuration(0);
-		d.bulk_erase();
-		usleep(5000);
-		d.test();
+		s.erase(command == "eraseall");
 		std::clog << "Done." << std::endl;
 
-	} else if (n_args == 0 && command == "program") {
+	} else if (command == "verify" && (n_args == 0 || (n_args == 1 && args[0] == "--fast"))) {
+		bool fast = n_args == 1;
 		MemoryDump m;
-		std::clog << "Reading Intel HEX formatted data..." << std::endl;
-		m.load_ihex(std::cin);
-		connect();
-		if (m.device_id_set) {
-			if (m.device_id == device_id) {
-				std::clog << "Device ID matches." << std::endl;
-			} else {
-				throw std::runtime_error("Device ID does not match (hex file: " + hex_word(m.device_id) + ", device: " + hex_word(device_id) + ").");
-			}
-		}
-		if (m.revision_id_set) {
-			if (m.revision_id == revision_id) {
-				std::clog << "Revision ID matches." << std::endl;
-			} else {
-				throw std::runtime_error("Revision ID does not match (hex file: " + hex_word(m.revision_id) + ", device: " + hex_word(revision_id) + ").");
-			}
-		}
-		if (!m.configuration_set) {
-			std::clog << "Warning: No configuration bits are given. The configuration bits will be erased but not programmed, thus left at all bits set." << std::endl;
-		}
-		std::clog << "Erasing..." << std::endl;
-		if (m.user_id_set) {
-			d.load_configuration(0);
-		} else {
-			d.reset_address();
-		}
-		d.bulk_erase();
-		usleep(5000);
-		std::clog << "Writing " << m.memory_used << " words to program memory..." << std::endl;
-		d.reset_address();
-		size_t latches_filled = 0;
-		for (size_t a = 0; a < m.memory_used; ++a) {
-			d.load_data(m.memory[a]);
-			if (++latches_filled == 32 || a == m.memory_used - 1) {
-				d.begin_programming();
-				d.test();
-				usleep(2500);
-				latches_filled = 0;
-				if (showprogress) print_progress(a, m.memory_used - 1);
-			}
-			d.increment_address();
-		}
-		if (showprogress) std::clog << std::endl;
-		std::clog << "Verifying program memory..." << std::endl;
-		d.reset_address();
-		for (size_t a = 0; a < m.memory_used; ++a) {
-			uint16_t v = d.read_data();
-			if (v != m.memory[a]) verify_failure("program memory", m.memory[a], v);
-			if (showprogress) print_progress(a, m.memory_used - 1);
-			d.increment_address();
-		}
-		if (showprogress) std::clog << std::endl;
-		if (m.configuration_set || m.user_id_set) {
-			d.load_configuration(0);
-			if (m.user_id_set) {
-				std::clog << "Writing and verifying user id..." << std::endl;
-				for (size_t i = 0; i < 4; ++i) {
-					d.load_data(m.user_id[i]);
-					d.begin_programming();
-					usleep(5000);
-					uint16_t v = d.read_data();
-					if (v != m.user_id[i]) verify_failure("user id", m.user_id[i], v);
-					d.increment_address();
-					if (showprogress) print_progress(i, 3);
-				}
-				if (showprogress) std::clog << std::endl;
-			} else {
-			}
-			if (m.configuration_set) {
-				for (size_t i = 0; i < (m.user_id_set ? 3 : 7); ++i) d.increment_address();
-				std::clog << "Writing and verifying configuration bits..." << std::endl;
-				for (size_t i = 0; i < 2; ++i) {
-					d.load_data(m.configuration[i]);
-					d.begin_programming();
-					usleep(5000);
-					uint16_t v = d.read_data();
-					if (v != m.configuration[i]) verify_failure("configuration bits", m.configuration[i], v);
-					d.increment_address();
-					if (showprogress) print_progress(i, 1);
-				}
-				if (showprogress) std::clog << std::endl;
-			}
+		std::clog << "Reading image..." << std::endl;
+		m.load(std::cin);
+		s.connect();
+		s.check_image(m);
+		s.verify(m, fast);
+
+	} else if (n_args == 1 && command == "program" && args[0] == "--stream") {
+		std::shared_ptr<ImageStream> stream = stream_stdin();
+		Journal journal(journal_directory(), dev);
+		s.journal = &journal;
+		s.program(*stream);
+
+	} else if (command == "program" && (n_args == 0 || (n_args == 1 && (args[0] == "--incremental" || args[0] == "--resume")))) {
+		bool incremental = n_args == 1 && args[0] == "--incremental";
+		bool resume = n_args == 1 && args[0] == "--resume";
+		MemoryDump m;
+		std::clog << "Reading image..." << std::endl;
+		m.load(std::cin);
+		Journal journal(journal_directory(), dev);
+		s.journal = &journal;
+		s.connect();
+		s.check_image(m);
+		if (resume) s.resume(m);
+		else s.program(m, incremental);
+
+	} else if (n_args == 1 && command == "watch") {
+		MemoryDump m;
+		std::clog << "Reading image..." << std::endl;
+		std::ifstream file(args[0], std::ios::binary);
+		if (!file) throw std::runtime_error("Unable to open " + args[0] + ".");
+		m.load(file);
+		if (watch(s, m)) {
+			phases.begin("end");
+			s.end();
+			return 1;
 		}
-		std::clog << "Done." << std::endl;
 
 	} else {
 		std::clog << "Unknown command." << std::endl;
@@ -397,7 +458,9 @@ int main(int argc, char * * argv) try {
 		return 1;
 	}
 
-	d.end();
+	phases.begin("end");
+	s.end();
+	return 0;
 
 } catch (std::exception & e) {
 	std::clog << e.what() << std::endl;
@@ -0,0 +1,372 @@
+// picpd: Keeps programmers open, and runs the jobs it gets over a Unix domain socket.
+//
+// picpd [--socket=path] [port...]
+//     Serve the given ports, or all ports that picp finds by default.
+//
+// Every connection to the socket is one job: a single line with a command, answered with
+// the output of the job, messages prefixed with "# ", and a final line that starts with
+// either "OK" or "ERROR". Commands:
+//
+//   program port file [--incremental]
+//   verify port file [--fast]
+//   dump port
+//   config port
+//   status
+//
+// The file is read by picpd itself, and can be Intel HEX or an image made by `picp compile`.
+// Parsed images are kept in a cache, by the hash of the contents of the file.
+// Jobs for the same port run in the order they arrived, jobs for different ports run at the same time.
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libpicp.hpp"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::duration d) {
+	return std::chrono::duration<double>(d).count();
+}
+
+std::vector<std::string> split(std::string const & line) {
+	std::vector<std::string> words;
+	std::istringstream s(line);
+	std::string w;
+	while (s >> w) words.push_back(w);
+	return words;
+}
+
+// Parsed images, by the hash of the file they were loaded from.
+struct ImageCache {
+
+	static size_t const max_size = 64;
+
+	std::shared_ptr<MemoryDump const> get(std::string const & path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) throw std::runtime_error("Unable to open " + path + ".");
+		std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (file.bad()) throw std::runtime_error("Unable to read " + path + ".");
+
+		// FNV-1a, like MemoryDump::hash().
+		uint64_t h = 0xcbf29ce484222325;
+		for (unsigned char c : data) h = (h ^ c) * 0x100000001b3;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto i = images.find(h);
+			if (i != images.end()) {
+				++hits;
+				i->second.second = ++clock;
+				return i->second.first;
+			}
+			++misses;
+		}
+
+		// Parse without holding the lock, so other jobs don't have to wait for this one.
+		std::shared_ptr<MemoryDump> m(new MemoryDump);
+		m->load(data.data(), data.size());
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (images.size() >= max_size) {
+			auto oldest = std::min_element(images.begin(), images.end(), [] (Entry const & a, Entry const & b) {
+				return a.second.second < b.second.second;
+			});
+			images.erase(oldest);
+		}
+		images[h] = std::make_pair(m, ++clock);
+		return m;
+	}
+
+	std::string status() {
+		std::lock_guard<std::mutex> lock(mutex);
+		char line[128];
+		snprintf(line, sizeof(line), "cache: %zu images, %zu hits, %zu misses\n", images.size(), hits, misses);
+		return line;
+	}
+
+private:
+	// The image, and when it was last used.
+	typedef std::pair<uint64_t const, std::pair<std::shared_ptr<MemoryDump const>, uint64_t>> Entry;
+	std::map<uint64_t, std::pair<std::shared_ptr<MemoryDump const>, uint64_t>> images;
+	uint64_t clock = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+	std::mutex mutex;
+
+};
+
+ImageCache cache;
+
+struct Job {
+	std::vector<std::string> words;
+	std::shared_ptr<MemoryDump const> image;
+	Clock::time_point queued = Clock::now();
+	std::promise<std::string> reply;
+};
+
+// A port, with the queue of jobs for it and the thread that runs them.
+// The programmer is opened by the first job, and stays open until something goes wrong with it.
+struct Worker {
+
+	std::string port;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<std::shared_ptr<Job>> queue;
+	bool busy = false;
+	bool stopping = false; // Set by the destructor. The thread stops once the queue is empty.
+
+	// Jobs that were finished, and how long they took from being queued until finishing, in seconds.
+	size_t done = 0;
+	size_t failed = 0;
+	double last_latency = 0;
+	double total_latency = 0;
+	double max_latency = 0;
+
+	explicit Worker(std::string const & port) : port(port), thread([this] { run(); }) {}
+
+	// Finishes the queued jobs, and stops the thread.
+	~Worker() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+			wake.notify_one();
+		}
+		thread.join();
+	}
+
+	void submit(std::shared_ptr<Job> const & job) {
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(job);
+		wake.notify_one();
+	}
+
+	std::string status() {
+		std::lock_guard<std::mutex> lock(mutex);
+		char line[256];
+		snprintf(line, sizeof(line), "%s: %zu queued, %s, %zu done, %zu failed, latency last %.3f s, mean %.3f s, max %.3f s\n",
+			port.c_str(), queue.size(), busy ? "busy" : "idle", done, failed,
+			last_latency, done + failed ? total_latency / (done + failed) : 0., max_latency);
+		return line;
+	}
+
+private:
+	// Messages from the session of the current job.
+	std::stringstream log;
+
+	// Last, so it starts after everything else is initialized.
+	std::thread thread;
+
+	void run() {
+		std::unique_ptr<Programmer> programmer;
+		for (;;) {
+			std::shared_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return !queue.empty() || stopping; });
+				if (queue.empty()) return;
+				job = queue.front();
+				queue.pop_front();
+				busy = true;
+			}
+
+			auto start = Clock::now();
+			std::ostringstream out;
+			std::string result;
+			log.str("");
+			log.clear();
+			try {
+				if (!programmer) programmer.reset(new Programmer(port.c_str(), log));
+				execute(programmer->session, *job, out);
+			} catch (std::exception & e) {
+				result = std::string("ERROR ") + e.what();
+				try {
+					if (programmer) programmer->session.end();
+				} catch (std::exception &) {
+					// The programmer itself is in trouble. Open it again for the next job.
+					programmer.reset();
+				}
+			}
+			auto end = Clock::now();
+
+			if (result.empty()) {
+				char line[64];
+				snprintf(line, sizeof(line), "OK queued=%.3f run=%.3f", seconds(start - job->queued), seconds(end - start));
+				result = line;
+			}
+			std::string reply;
+			std::string l;
+			while (std::getline(log, l)) reply += "# " + l + "\n";
+			reply += out.str() + result + "\n";
+			job->reply.set_value(reply);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			busy = false;
+			++(result[0] == 'O' ? done : failed);
+			last_latency = seconds(end - job->queued);
+			total_latency += last_latency;
+			max_latency = std::max(max_latency, last_latency);
+		}
+	}
+
+	static void execute(Session & s, Job const & job, std::ostream & out) {
+		auto & command = job.words[0];
+		bool flag = job.words.size() > 3;
+		s.connect();
+		if (command == "program") {
+			s.check_image(*job.image);
+			s.program(*job.image, flag);
+		} else if (command == "verify") {
+			s.check_image(*job.image);
+			s.verify(*job.image, flag);
+		} else if (command == "dump") {
+			IhexWriter w(out, 16);
+			std::vector<uint16_t> memory = s.read_program(0, s.device->program_size);
+			w.words(0, memory.data(), memory.size());
+			std::vector<uint16_t> configuration = s.read_config();
+			w.words(0x8000, configuration.data(), configuration.size());
+			w.end();
+		} else if (command == "config") {
+			std::vector<uint16_t> configuration = s.read_config();
+			for (size_t i = 0; i < configuration.size(); ++i) {
+				char line[32];
+				snprintf(line, sizeof(line), "%04X: 0x%04X\n", unsigned(0x8000 + i), configuration[i]);
+				out << line;
+			}
+		}
+		s.end();
+	}
+
+};
+
+std::map<std::string, std::unique_ptr<Worker>> workers;
+
+// Check a request, and turn it into a job for the worker of its port. Throws if the request is invalid.
+std::pair<Worker *, std::shared_ptr<Job>> parse(std::string const & line) {
+	std::shared_ptr<Job> job(new Job);
+	job->words = split(line);
+	auto & w = job->words;
+	if (w.empty()) throw std::runtime_error("Empty request.");
+	auto & command = w[0];
+	bool valid =
+		(command == "program" && (w.size() == 3 || (w.size() == 4 && w[3] == "--incremental"))) ||
+		(command == "verify" && (w.size() == 3 || (w.size() == 4 && w[3] == "--fast"))) ||
+		((command == "dump" || command == "config") && w.size() == 2);
+	if (!valid) throw std::runtime_error("Invalid request: " + line);
+	auto i = workers.find(w[1]);
+	if (i == workers.end()) throw std::runtime_error("Unknown port: " + w[1]);
+	if (w.size() > 2) job->image = cache.get(w[2]);
+	return std::make_pair(i->second.get(), job);
+}
+
+std::string status() {
+	std::string s;
+	for (auto & w : workers) s += w.second->status();
+	return s + cache.status() + "OK\n";
+}
+
+void write_all(int fd, std::string const & data) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t r = ::write(fd, data.data() + done, data.size() - done);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return; // The client went away. Nothing to tell it anymore.
+		done += r;
+	}
+}
+
+void serve(int fd) {
+	std::string line;
+	char c;
+	while (line.size() < 4096) {
+		ssize_t r = ::read(fd, &c, 1);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0 || c == '\n') break;
+		line += c;
+	}
+	std::string reply;
+	try {
+		if (line == "status") {
+			reply = status();
+		} else {
+			auto p = parse(line);
+			auto result = p.second->reply.get_future();
+			p.first->submit(p.second);
+			reply = result.get();
+		}
+	} catch (std::exception & e) {
+		reply = std::string("ERROR ") + e.what() + "\n";
+	}
+	write_all(fd, reply);
+	close(fd);
+}
+
+}
+
+int main(int argc, char * * argv) try {
+
+	std::string socket_path = "/tmp/picpd.sock";
+	std::vector<std::string> ports;
+	for (int i = 1; i < argc; ++i) {
+		if (!strncmp(argv[i], "--socket=", 9)) {
+			socket_path = argv[i] + 9;
+		} else if (argv[i][0] == '-') {
+			std::clog << "Usage: " << argv[0] << " [--socket=path] [port...]\n";
+			return 1;
+		} else {
+			ports.push_back(argv[i]);
+		}
+	}
+	if (ports.empty()) ports = find_ports();
+	if (ports.empty()) ports.push_back(default_port);
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path)) throw std::runtime_error("Socket path too long.");
+	strcpy(address.sun_path, socket_path.c_str());
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) throw std::runtime_error(std::string("Unable to create socket: ") + strerror(errno));
+	unlink(socket_path.c_str());
+	if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0) throw std::runtime_error("Unable to bind to " + socket_path + ": " + strerror(errno));
+	if (listen(listener, 64) < 0) throw std::runtime_error(std::string("Unable to listen: ") + strerror(errno));
+
+	// (Only once the socket is set up, such that failing to do that doesn't leave threads behind.)
+	for (auto & p : ports) workers[p].reset(new Worker(p));
+
+	// A client that disconnects early should not take the daemon down.
+	signal(SIGPIPE, SIG_IGN);
+
+	std::clog << "Serving";
+	for (auto & p : ports) std::clog << ' ' << p;
+	std::clog << " on " << socket_path << "." << std::endl;
+
+	for (;;) {
+		int fd = accept(listener, 0, 0);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			throw std::runtime_error(std::string("Unable to accept: ") + strerror(errno));
+		}
+		std::thread(serve, fd).detach();
+	}
+
+} catch (std::exception & e) {
+	std::clog << e.what() << std::endl;
+	return 1;
+}
@@ -0,0 +1,104 @@
+// Plays back a trace recorded with `picp --trace=file`, or shows its timing profile.
+//
+// picp-replay [--timing] trace [picp arguments]
+//     Run picp against the trace instead of a programmer. What picp sends is checked against
+//     the trace, so this shows whether changes to picp still result in exactly the same traffic.
+//     With --timing, replies are delayed as long as they took when the trace was recorded.
+//
+// picp-replay --profile trace
+//     Show the round trip latencies, the gaps in which picp was not waiting for the programmer,
+//     and where the time went.
+
+#define PICP_REPLAY_PORT
+#define main picp_main
+#include "picp.cpp"
+#undef main
+#include "libpicp.cpp"
+
+#include <algorithm>
+
+namespace {
+
+void profile(std::vector<TraceRecord> const & records) {
+	size_t bytes_sent = 0;
+	size_t bytes_received = 0;
+	PortStats latency;
+
+	// Time between receiving a reply and sending something again: picp is busy or sleeping, and the link is idle.
+	struct Gap { uint64_t time; uint64_t length; };
+	std::vector<Gap> gaps;
+	uint64_t idle = 0;
+
+	for (size_t i = 0; i < records.size(); ++i) {
+		auto & r = records[i];
+		if (r.direction == 'S') {
+			bytes_sent += r.data.size();
+			if (i > 0 && records[i - 1].direction == 'R') {
+				Gap g = { records[i - 1].time, r.time - records[i - 1].time };
+				gaps.push_back(g);
+				idle += g.length;
+			}
+		} else {
+			bytes_received += r.data.size();
+			uint64_t previous = i > 0 ? records[i - 1].time : 0;
+			latency.round_trip(std::chrono::microseconds(r.time - previous));
+		}
+	}
+
+	uint64_t total = records.empty() ? 0 : records.back().time;
+	printf("%zu records, %.6f s.\n", records.size(), total / 1e6);
+	printf("%zu bytes sent, %zu bytes received.\n", bytes_sent, bytes_received);
+	printf("%zu replies, waited for %.6f s in total (%.0f us on average).\n", latency.round_trips, latency.wait_time, latency.round_trips ? latency.wait_time * 1e6 / latency.round_trips : 0.);
+	printf("Link idle (picp busy or sleeping) for %.6f s in %zu gaps.\n", idle / 1e6, gaps.size());
+	printf("\nReply latency:\n");
+	for (size_t i = 0; i < PortStats::latency_buckets; ++i) {
+		if (latency.latency[i]) printf("\t%8u us and up: %zu\n", i ? 1u << i : 0u, latency.latency[i]);
+	}
+	std::sort(gaps.begin(), gaps.end(), [] (Gap const & a, Gap const & b) { return a.length > b.length; });
+	if (!gaps.empty()) printf("\nLongest gaps:\n");
+	for (size_t i = 0; i < gaps.size() && i < 5; ++i) {
+		printf("\t%10.6f s at %.6f s\n", gaps[i].length / 1e6, gaps[i].time / 1e6);
+	}
+}
+
+}
+
+int main(int argc, char * * argv) try {
+
+	bool show_profile = false;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; ++i) {
+		     if (!strcmp(argv[i], "--profile")) show_profile = true;
+		else if (!strcmp(argv[i], "--timing")) replay.timing = true;
+		else break;
+	}
+	if (i >= argc || (show_profile && i + 1 != argc)) {
+		std::clog << "Usage:\n";
+		std::clog << '\t' << argv[0] << " [--timing] trace [picp arguments]\n";
+		std::clog << "\t\tRun picp against a trace recorded with --trace, instead of against a programmer.\n";
+		std::clog << "\t\tWith --timing, replies take as long as they did when the trace was recorded.\n\n";
+		std::clog << '\t' << argv[0] << " --profile trace\n";
+		std::clog << "\t\tShow the timing profile of a trace.\n";
+		return 1;
+	}
+
+	replay.records = read_trace(argv[i]);
+
+	if (show_profile) {
+		profile(replay.records);
+		return 0;
+	}
+
+	std::vector<char *> args;
+	args.push_back(argv[0]);
+	args.insert(args.end(), argv + i + 1, argv + argc);
+	args.push_back(0);
+	int status = picp_main(args.size() - 1, args.data());
+	std::clog << "Replayed " << replay.replayed() << " of " << replay.records.size() << " records." << std::endl;
+	if (status == 0 && replay.replayed() != replay.records.size()) return 1;
+	return status;
+
+} catch (std::exception & e) {
+	std::clog << e.what() << std::endl;
+	return 1;
+}
@@ -0,0 +1,136 @@
+// A Port that plays back a trace recorded with --trace, instead of talking to a programmer.
+// Used by picp-replay instead of linux.hpp.
+//
+// Everything that is sent is checked against what was sent in the trace,
+// and the data that was received in the trace is given back in the same blocks.
+
+#include <thread>
+#include <vector>
+
+#include <string.h>
+#include <unistd.h>
+
+struct Replay {
+
+	std::vector<TraceRecord> records;
+
+	// Wait as long as the programmer took to reply when the trace was recorded.
+	bool timing = false;
+
+	// The record that is next, and how much of it was already sent.
+	size_t next = 0;
+	size_t offset = 0;
+
+	size_t bytes_sent = 0;
+
+	// The time of the last flush or fill, to reproduce the time between records.
+	std::chrono::steady_clock::time_point last;
+
+	// The number of records that were completely replayed.
+	size_t replayed() const {
+		return next + (next < records.size() && offset > 0 && offset == records[next].data.size());
+	}
+
+};
+
+Replay replay;
+
+struct Port {
+
+private:
+	std::vector<uint8_t> out;
+	std::vector<uint8_t> in;
+	size_t in_pos = 0;
+
+	Port(Port const &);
+	Port & operator = (Port const &);
+
+public:
+
+	PortStats stats;
+	TraceWriter * trace = 0;
+
+	Port(char const *) {
+		replay.last = std::chrono::steady_clock::now();
+	}
+
+	void write(uint8_t b) {
+		out.push_back(b);
+		if (out.size() >= 4096) flush();
+	}
+
+	void flush() {
+		auto & records = replay.records;
+		for (uint8_t b : out) {
+			while (replay.next < records.size() && records[replay.next].direction == 'S' && replay.offset == records[replay.next].data.size()) {
+				++replay.next;
+				replay.offset = 0;
+			}
+			if (replay.next == records.size()) throw std::runtime_error("Replay diverged: more is sent than in the trace.");
+			auto & r = records[replay.next];
+			if (r.direction != 'S') throw std::runtime_error("Replay diverged: more is sent before waiting for a reply than in the trace (byte " + std::to_string(replay.bytes_sent) + ").");
+			if (r.data[replay.offset] != b) {
+				std::stringstream s;
+				s << "Replay diverged: byte " << replay.bytes_sent << " sent is 0x" << std::hex << unsigned(b);
+				s << ", but it was 0x" << unsigned(r.data[replay.offset]) << " in the trace.";
+				throw std::runtime_error(s.str());
+			}
+			++replay.offset;
+			++replay.bytes_sent;
+		}
+		stats.bytes_written += out.size();
+		if (!out.empty()) {
+			++stats.syscalls;
+			replay.last = std::chrono::steady_clock::now();
+		}
+		out.clear();
+	}
+
+	uint8_t read() {
+		if (in_pos == in.size()) fill();
+		return in[in_pos++];
+	}
+
+private:
+	void fill() {
+		flush();
+		auto & records = replay.records;
+		auto start = std::chrono::steady_clock::now();
+		if (replay.next < records.size() && records[replay.next].direction == 'S' && replay.offset == records[replay.next].data.size()) {
+			++replay.next;
+			replay.offset = 0;
+		}
+		if (replay.next == records.size()) throw std::runtime_error("Unable to read: The trace ends here.");
+		auto & r = records[replay.next];
+		if (r.direction != 'R' || replay.offset != 0) throw std::runtime_error("Replay diverged: waiting for a reply before everything in the trace was sent (byte " + std::to_string(replay.bytes_sent) + ").");
+		if (replay.timing && replay.next > 0) {
+			std::this_thread::sleep_until(replay.last + std::chrono::microseconds(r.time - records[replay.next - 1].time));
+		}
+		++replay.next;
+		in = r.data;
+		in_pos = 0;
+		++stats.syscalls;
+		stats.bytes_read += in.size();
+		auto now = std::chrono::steady_clock::now();
+		stats.round_trip(now - start);
+		replay.last = now;
+	}
+
+};
+
+char const * const default_port = "trace";
+
+inline bool is_port(char const * p) {
+	return p[0] == '/' || !strcmp(p, default_port);
+}
+
+inline std::vector<std::string> find_ports() {
+	return std::vector<std::string>();
+}
+
+inline void binary_stdin() {}
+
+// Replays don't keep journals, so they don't depend on what happened before.
+inline std::string journal_directory() {
+	return "";
+}
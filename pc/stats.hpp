@@ -0,0 +1,62 @@
+// Counters and timers for --stats.
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What a Port did, kept by the Port itself.
+struct PortStats {
+
+	size_t bytes_written = 0;
+	size_t bytes_read = 0;
+	size_t syscalls = 0;
+
+	// Times the Port had to wait for the programmer, and for how long in total (in seconds).
+	size_t round_trips = 0;
+	double wait_time = 0;
+
+	// latency[i] counts the round trips that took at least 2^i microseconds, but less than 2^(i+1).
+	// (The first also counts everything shorter, and the last everything longer.)
+	static size_t const latency_buckets = 24;
+	size_t latency[latency_buckets] = {};
+
+	void round_trip(std::chrono::steady_clock::duration d) {
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+		size_t i = 0;
+		while (i + 1 < latency_buckets && us >= 2 << i) ++i;
+		++latency[i];
+		++round_trips;
+		wait_time += std::chrono::duration<double>(d).count();
+	}
+
+};
+
+// The time spent in each phase of a command, in the order they were started.
+struct Phases {
+
+	std::vector<std::pair<std::string, double>> times;
+
+	// End the current phase (if any), and start the given one.
+	// Time spent in a phase that was already seen before is added to that phase.
+	void begin(std::string const & name) {
+		end();
+		current = name;
+		start = std::chrono::steady_clock::now();
+	}
+
+	void end() {
+		if (current.empty()) return;
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		auto i = times.begin();
+		while (i != times.end() && i->first != current) ++i;
+		if (i == times.end()) times.push_back(std::make_pair(current, t));
+		else i->second += t;
+		current.clear();
+	}
+
+private:
+	std::string current;
+	std::chrono::steady_clock::time_point start;
+
+};
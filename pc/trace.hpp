@@ -0,0 +1,105 @@
+// Recording of everything that goes over the wire, for --trace and picp-replay.
+//
+// A trace file starts with "PICPTRC1", followed by one record for every block of data
+// that was sent to or received from the programmer:
+//   - The direction: 'S' (sent) or 'R' (received).
+//   - The time since the previous record (or the start), in microseconds.
+//   - The number of bytes.
+//   - The bytes themselves.
+// Both numbers are encoded as LEB128: seven bits per byte, least significant first,
+// with the high bit set on all but the last byte.
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+char const trace_magic[9] = "PICPTRC1";
+
+struct TraceWriter {
+
+	TraceWriter(char const * path) {
+		file = fopen(path, "wb");
+		if (!file) throw std::runtime_error(std::string("Unable to open ") + path + ".");
+		fwrite(trace_magic, 1, 8, file);
+		last = std::chrono::steady_clock::now();
+	}
+
+	~TraceWriter() {
+		fclose(file);
+	}
+
+	void record(char direction, uint8_t const * data, size_t size) {
+		auto now = std::chrono::steady_clock::now();
+		buffer.clear();
+		buffer.push_back(direction);
+		put(std::chrono::duration_cast<std::chrono::microseconds>(now - last).count());
+		put(size);
+		buffer.insert(buffer.end(), data, data + size);
+		fwrite(buffer.data(), 1, buffer.size(), file);
+		last = now;
+	}
+
+private:
+	FILE * file;
+	std::chrono::steady_clock::time_point last;
+	std::vector<uint8_t> buffer;
+
+	TraceWriter(TraceWriter const &);
+	TraceWriter & operator = (TraceWriter const &);
+
+	void put(uint64_t v) {
+		while (v >= 0x80) {
+			buffer.push_back(0x80 | (v & 0x7F));
+			v >>= 7;
+		}
+		buffer.push_back(v);
+	}
+
+};
+
+struct TraceRecord {
+	char direction;
+	uint64_t time; // Microseconds since the start of the trace.
+	std::vector<uint8_t> data;
+};
+
+inline std::vector<TraceRecord> read_trace(char const * path) {
+	FILE * file = fopen(path, "rb");
+	if (!file) throw std::runtime_error(std::string("Unable to open ") + path + ".");
+	std::string data;
+	char buffer[65536];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) data.append(buffer, n);
+	fclose(file);
+	if (data.compare(0, 8, trace_magic) != 0) throw std::runtime_error(std::string(path) + " is not a trace.");
+
+	size_t i = 8;
+	auto get = [&] () {
+		uint64_t v = 0;
+		for (unsigned int shift = 0; ; shift += 7) {
+			if (i >= data.size() || shift > 63) throw std::runtime_error("Trace is truncated or corrupt.");
+			uint8_t b = data[i++];
+			v |= uint64_t(b & 0x7F) << shift;
+			if (!(b & 0x80)) return v;
+		}
+	};
+	std::vector<TraceRecord> records;
+	uint64_t time = 0;
+	while (i < data.size()) {
+		TraceRecord r;
+		r.direction = data[i++];
+		if (r.direction != 'S' && r.direction != 'R') throw std::runtime_error("Trace is truncated or corrupt.");
+		time += get();
+		r.time = time;
+		uint64_t size = get();
+		if (size > data.size() - i) throw std::runtime_error("Trace is truncated or corrupt.");
+		r.data.assign(data.begin() + i, data.begin() + i + size);
+		i += size;
+		records.push_back(r);
+	}
+	return records;
+}
@@ -1,53 +1,116 @@
 #include <windows.h>
 #include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
 
 struct Port {
 
 private:
 	HANDLE handle;
 
+	std::vector<uint8_t> out;
+	std::vector<uint8_t> in;
+	size_t in_pos = 0;
+
 	Port(Port const &);
 	Port & operator = (Port const &);
 
 public:
 
+	PortStats stats;
+
+	// If set, everything that is sent and received is recorded here.
+	TraceWriter * trace = 0;
+
 	Port(char const * f) {
 		std::string name = "\\\\.\\"; name += f;
 		handle = CreateFile(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
 		if (handle == INVALID_HANDLE_VALUE) throw std::runtime_error(std::string("Unable to open ") + f + ".");
 		COMMTIMEOUTS t;
-		t.ReadIntervalTimeout = 0;
+		t.ReadIntervalTimeout = MAXDWORD;
 		t.ReadTotalTimeoutConstant = 100;
-		t.ReadTotalTimeoutMultiplier = 0;
+		t.ReadTotalTimeoutMultiplier = MAXDWORD;
 		t.WriteTotalTimeoutMultiplier = 0;
 		t.WriteTotalTimeoutConstant = 0;
 		SetCommTimeouts(handle, &t);
+		// Throw away replies that an earlier interrupted run left behind.
+		PurgeComm(handle, PURGE_RXCLEAR);
 	}
 
 	void write(uint8_t b) {
-		DWORD written = 0;
-		if (!WriteFile(handle, &b, 1, &written, 0) || written != 1) throw std::runtime_error("Unable to write data.");
+		out.push_back(b);
+		if (out.size() >= 4096) flush();
+	}
+
+	void flush() {
+		size_t done = 0;
+		while (done < out.size()) {
+			DWORD written = 0;
+			if (!WriteFile(handle, out.data() + done, out.size() - done, &written, 0)) throw std::runtime_error("Unable to write data.");
+			++stats.syscalls;
+			done += written;
+		}
+		stats.bytes_written += out.size();
+		if (trace && !out.empty()) trace->record('S', out.data(), out.size());
+		out.clear();
 	}
 
 	uint8_t read() {
-		uint8_t b;
-		DWORD read = 0;
-		if (!ReadFile(handle, &b , 1, &read, 0) || read != 1) throw std::runtime_error("Unable to read data.");
-		return b;
+		if (in_pos == in.size()) fill();
+		return in[in_pos++];
 	}
 
 	~Port() {
+		try { flush(); } catch (...) {}
 		CloseHandle(handle);
 	}
 
+private:
+	void fill() {
+		flush();
+		auto start = std::chrono::steady_clock::now();
+		uint8_t buffer[4096];
+		DWORD read = 0;
+		if (!ReadFile(handle, buffer, sizeof(buffer), &read, 0) || read == 0) throw std::runtime_error("Unable to read data.");
+		++stats.syscalls;
+		in.assign(buffer, buffer + read);
+		in_pos = 0;
+		stats.bytes_read += read;
+		if (trace) trace->record('R', buffer, read);
+		stats.round_trip(std::chrono::steady_clock::now() - start);
+	}
+
 };
 
 inline void usleep(unsigned int microseconds) {
 	Sleep((microseconds + 999) / 1000);
 }
 
-char const * default_port = "COM5";
+char const * const default_port = "COM5";
 
 inline bool is_port(char const * p) {
 	return p[0] == 'C' && p[1] == 'O' & p[2] == 'M';
 }
+
+// COM ports can't be told apart from other serial ports, so they have to be given explicitly.
+inline std::vector<std::string> find_ports() {
+	return std::vector<std::string>();
+}
+
+// Compiled images are binary, so stdin must not be translated.
+inline void binary_stdin() {
+	_setmode(_fileno(stdin), _O_BINARY);
+}
+
+// Where the journals of `program` are kept: %LOCALAPPDATA%\picp, created if needed.
+inline std::string journal_directory() {
+	char const * local = getenv("LOCALAPPDATA");
+	if (!local || !*local) return "";
+	std::string d = std::string(local) + "\\picp";
+	_mkdir(d.c_str());
+	return d;
+}
@@ -33,25 +33,46 @@ enum {
 	icsp_cmd_row_erase                          = 0x11
 };
 
-BOOL usb_tasks(void) {
-	USBDeviceTasks();
-	if (USBDeviceState < CONFIGURED_STATE || USBSuspendControl) return 0;
-	CDCTxService();
-	return 1;
+// ICSP timing (DS41620C, table 8-1). One instruction takes 83 ns at 12 MIPS.
+//  - TCKH, TCKL (clock high and low time): at least 100 ns.
+//  - TDS, TDH (data setup and hold time around the falling edge): at least 100 ns.
+//  - TCO (rising edge to data output valid): at most 80 ns.
+//  - TDLY (after a command, before its data or the next command): at least 1 us.
+// Every edge below is followed by at least two other instructions before the next one,
+// which covers all but TDLY. Set and clear are single bsf/bcf instructions on LATC,
+// which (unlike PORTC) doesn't suffer from read-modify-write problems.
+#define ICSPDAT LATCbits.LATC0
+#define ICSPCLK LATCbits.LATC1
+
+// Extra delay in every half clock period, set with 'F'. Zero is as fast as the timing above allows.
+unsigned char icsp_delay = 0;
+
+void icsp_wait(void) {
+	unsigned char i = icsp_delay;
+	do NOP(); while (--i);
 }
 
-void icsp_bit(char x) {
-	if (x) LATC |= 1;
-	else   LATC &= ~1;
-	LATC |= 1 << 1;
-	LATC &= ~(1 << 1);
+#define ICSP_HALF_PERIOD() do { if (icsp_delay) icsp_wait(); } while (0)
+
+// Clock out the lowest n bits of x, least significant bit first.
+// The target takes the data on the falling edge.
+void icsp_out(unsigned int x, unsigned char n) {
+	do {
+		ICSPDAT = x & 1;
+		ICSPCLK = 1;
+		x >>= 1;
+		ICSP_HALF_PERIOD();
+		ICSPCLK = 0;
+		ICSP_HALF_PERIOD();
+	} while (--n);
 }
 
 void icsp_begin() {
 	TRISC = ~7; // Use RC0 RC1 and RC2 as outputs
 	LATC = 0;
-	for (size_t i = 0; i < 32; ++i) icsp_bit(0x4D434850 >> i & 1);
-	icsp_bit(0);
+	icsp_out(0x4850, 16); // "MCHP", least significant bit first.
+	icsp_out(0x4D43, 16);
+	icsp_out(0, 1);
 }
 
 void icsp_end() {
@@ -59,50 +80,205 @@ void icsp_end() {
 }
 
 void icsp_cmd(char c) {
-	for (size_t i = 0; i < 6; ++i) {
-		icsp_bit(c & 1);
-		c >>= 1;
-	}
+	icsp_out(c, 6);
+	_delay(12); // TDLY
 }
 
 void icsp_parameter(unsigned int p) {
-	p <<= 1;
-	for (size_t i = 0; i < 16; ++i) {
-		icsp_bit(p & 1);
-		p >>= 1;
-	}
+	icsp_out(p << 1, 16);
 }
 
 unsigned int icsp_read() {
-	TRISC |= 1;
+	TRISCbits.TRISC0 = 1;
 	unsigned int result = 0;
-	for (size_t i = 0; i < 16; ++i) {
-		LATC |= 1 << 1;
-		LATC &= ~(1 << 1);
-		result |= (PORTC & 1) << i;
-	}
-	TRISC &= ~1;
+	unsigned char n = 16;
+	do {
+		ICSPCLK = 1;
+		result >>= 1; // (Also waits for TCO.)
+		ICSP_HALF_PERIOD();
+		if (PORTCbits.RC0) result |= 0x8000;
+		ICSPCLK = 0;
+		ICSP_HALF_PERIOD();
+	} while (--n);
+	TRISCbits.TRISC0 = 0;
 	return (result >> 1) & 0x3FFF;
 }
 
+// USB is handled by the interrupt handler, which moves data between the CDC endpoints
+// and the two ring buffers below. The main loop only executes commands from one ring,
+// and puts replies in the other, so that USB transfers continue while ICSP commands run.
+// Every ring index is only changed by one side.
+
+// Received bytes that are not yet processed.
+// Whole OUT packets are copied in here, as soon as there is room for one.
+#define RX_SIZE 128
+char rx_packet[CDC_DATA_OUT_EP_SIZE];
+char rx_ring[RX_SIZE];
+volatile unsigned char rx_head = 0; // Interrupt handler.
+volatile unsigned char rx_tail = 0; // Main loop.
+
+// Replies that are not yet sent.
+// Only full packets are sent, unless tx_push is set because there are no more commands to process.
+#define TX_SIZE 128
+char tx_packet[CDC_DATA_IN_EP_SIZE];
+char tx_ring[TX_SIZE];
+volatile unsigned char tx_head = 0; // Main loop.
+volatile unsigned char tx_tail = 0; // Interrupt handler.
+volatile BOOL tx_push = 0;
+
+void io_reset(void) {
+	rx_head = rx_tail = 0;
+	tx_head = tx_tail = 0;
+	tx_push = 0;
+}
+
+BOOL usb_ready(void) {
+	return USBDeviceState >= CONFIGURED_STATE && !USBSuspendControl;
+}
+
+// Move data between the CDC endpoints and the rings.
+// Only called by the interrupt handler, or with interrupts disabled.
+void usb_service(void) {
+	if (!usb_ready()) return;
+	// putUSBUSART() silently drops data while the previous transfer is still
+	// in progress, and only keeps a pointer to the data until it is sent.
+	// So only refill tx_packet when the previous packet is completely sent.
+	CDCTxService();
+	unsigned char queued = tx_head - tx_tail;
+	if (queued && USBUSARTIsTxTrfReady() && (queued >= CDC_DATA_IN_EP_SIZE || tx_push)) {
+		unsigned char n = queued < CDC_DATA_IN_EP_SIZE ? queued : CDC_DATA_IN_EP_SIZE;
+		for (unsigned char i = 0; i < n; ++i) tx_packet[i] = tx_ring[tx_tail++ % TX_SIZE];
+		if (tx_tail == tx_head) tx_push = 0;
+		putUSBUSART(tx_packet, n);
+		CDCTxService();
+	}
+	if ((unsigned char)(rx_head - rx_tail) <= RX_SIZE - CDC_DATA_OUT_EP_SIZE) {
+		unsigned char n = getsUSBUSART(rx_packet, CDC_DATA_OUT_EP_SIZE);
+		for (unsigned char i = 0; i < n; ++i) rx_ring[rx_head++ % RX_SIZE] = rx_packet[i];
+	}
+}
+
+void interrupt isr(void) {
+	USBDeviceTasks();
+	usb_service();
+}
+
+// Interrupts only come with USB activity. So after queueing replies, or making room for
+// received data, do the work of the interrupt handler right away, instead of waiting for it.
+void usb_kick(void) {
+	INTCONbits.GIE = 0;
+	usb_service();
+	INTCONbits.GIE = 1;
+}
+
+void put_byte(char c) {
+	while ((unsigned char)(tx_head - tx_tail) == TX_SIZE) {
+		if (!usb_ready()) return; // Nobody is listening anymore.
+		usb_kick();
+	}
+	tx_ring[tx_head % TX_SIZE] = c;
+	++tx_head;
+	if (tx_head % CDC_DATA_IN_EP_SIZE == 0) usb_kick();
+}
+
+BOOL get_byte(char * c) {
+	while (rx_head == rx_tail) {
+		if (!usb_ready()) return 0;
+		// Nothing left to do, so send whatever replies there are.
+		if (tx_head != tx_tail) tx_push = 1;
+		usb_kick();
+	}
+	*c = rx_ring[rx_tail % RX_SIZE];
+	++rx_tail;
+	// Fetch the next packet as soon as there is room for it.
+	if (rx_tail % CDC_DATA_OUT_EP_SIZE == 0) usb_kick();
+	return 1;
+}
+
+// Wait the given number of microseconds (at most 16383).
+void wait_us(unsigned int us) {
+	unsigned int ticks = us + (us >> 1); // Timer 1 runs at Fosc/4/8 = 1.5MHz.
+	T1CON = 0x30; // Fosc/4, 1:8 prescaler, stopped.
+	TMR1H = 0;
+	TMR1L = 0;
+	T1CONbits.TMR1ON = 1;
+	while (1) {
+		unsigned char h, l;
+		do {
+			h = TMR1H;
+			l = TMR1L;
+		} while (h != TMR1H);
+		if (((unsigned int)h << 8 | l) >= ticks) break;
+	}
+	T1CONbits.TMR1ON = 0;
+}
+
 BOOL read_value(unsigned int * value) {
 	char a, b;
-	while (!getsUSBUSART(&a, 1)) if (!usb_tasks()) return 0;
-	if (!(a & 0x80)) return 0;
-	while (!getsUSBUSART(&b, 1)) if (!usb_tasks()) return 0;
-	if (!(b & 0x80)) return 0;
+	if (!get_byte(&a) || !(a & 0x80)) return 0;
+	if (!get_byte(&b) || !(b & 0x80)) return 0;
 	*value = (a & 0x7F) << 7 | (b & 0x7F);
 	return 1;
 }
 
 void write_value(unsigned int v) {
-	char x[2];
-	x[0] = 0x80 | (v >> 7);
-	x[1] = 0x80 | v;
-	putUSBUSART(x, 2);
+	put_byte(0x80 | (v >> 7));
+	put_byte(0x80 | v);
+}
+
+void write_string(char const * s) {
+	while (*s) put_byte(*s++);
+}
+
+// Set the ICSP clock rate, in kHz. Rates above what the code above does by itself
+// (more than a MHz) just make it go as fast as it can. The slowest rate is about 6 kHz.
+void set_clock(void) {
+	unsigned int khz;
+	if (!read_value(&khz) || !khz) return;
+	// Instructions per half clock period, minus those of the code itself (about 6),
+	// divided by those of an iteration of icsp_wait() (4).
+	unsigned int half = 6000 / khz;
+	unsigned int n = half > 6 ? (half - 6) / 4 : 0;
+	icsp_delay = n > 255 ? 255 : n;
+}
+
+// Give an ICSP command that starts a self-timed operation, wait the time given
+// by the host, and then reply, such that the host knows it's done.
+void timed_cmd(char c) {
+	unsigned int us;
+	if (!read_value(&us)) return;
+	icsp_cmd(c);
+	wait_us(us);
+	put_byte('Y');
+}
+
+// Read the given number of words (with Increment Address after each), and
+// only reply with a Fletcher checksum over them: the sum of the words modulo
+// 0xFFFF, and the sum of those sums modulo 0xFFFF. (Unlike modulo 0x3FFF, an
+// erased word then doesn't count the same as 0x0000.) The sums are 16 bits,
+// so the lower 14 bits of both are sent first, followed by a word with the
+// upper 2 bits of the first sum in bits 0-1 and of the second in bits 2-3.
+void checksum(void) {
+	unsigned int n;
+	if (!read_value(&n)) return;
+	unsigned int a = 0, b = 0; // 16 bits.
+	while (n--) {
+		unsigned int v;
+		icsp_cmd(icsp_cmd_read_data);
+		v = icsp_read();
+		// End-around carry: Going past 0xFFFF wraps to 0x10000 - 0xFFFF = 1 too many.
+		a += v;
+		if (a < v) ++a; else if (a == 0xFFFF) a = 0;
+		b += a;
+		if (b < a) ++b; else if (b == 0xFFFF) b = 0;
+		icsp_cmd(icsp_cmd_increment_address);
+	}
+	write_value(a & 0x3FFF);
+	write_value(b & 0x3FFF);
+	write_value(a >> 14 | (b >> 14) << 2);
 }
 
-char version[] = "PIC16F145x programmer 1.1 by Mara Bos <m-ou.se@m-ou.se>\n";
+char const version[] = "PIC16F145x programmer 1.10 by Mara Bos <m-ou.se@m-ou.se>\n";
 
 int main(void) {
 	OSCTUNE = 0;
@@ -114,25 +290,36 @@ int main(void) {
 	OPTION_REG &= 0x7F; // WPUEN
 	WPUA = 1 << 5;
 	USBDeviceInit();
+	USBDeviceAttach();
+	INTCONbits.PEIE = 1;
+	INTCONbits.GIE = 1;
 
 	while (1) {
-		while (!usb_tasks());
 		char cmd;
-		if (getsUSBUSART(&cmd, 1)) {
-			     if (cmd == 'V') putUSBUSART(version, sizeof(version) - 1);
-			else if (cmd == 'T') { char r = 'Y'; putUSBUSART(&r, 1); }
+		if (get_byte(&cmd)) {
+			     if (cmd == 'V') write_string(version);
+			else if (cmd == 'T') put_byte('Y');
 			else if (cmd == 'B') icsp_begin();
 			else if (cmd == 'E') icsp_end();
 			else if (cmd == 'C') { unsigned int value; if (read_value(&value)) { icsp_cmd(icsp_cmd_load_configuration); icsp_parameter(value); } }
 			else if (cmd == 'L') { unsigned int value; if (read_value(&value)) { icsp_cmd(icsp_cmd_load_data); icsp_parameter(value); } }
 			else if (cmd == 'R') { icsp_cmd(icsp_cmd_read_data); write_value(icsp_read()); }
+			else if (cmd == 'W') { unsigned int n, value; if (read_value(&n)) while (n && read_value(&value)) { icsp_cmd(icsp_cmd_load_data); icsp_parameter(value); if (--n) icsp_cmd(icsp_cmd_increment_address); } }
+			else if (cmd == 'M') { unsigned int n, value; if (read_value(&n)) while (n && read_value(&value)) { icsp_cmd(icsp_cmd_read_data); write_value(icsp_read()); icsp_cmd(icsp_cmd_load_data); icsp_parameter(value); icsp_cmd(icsp_cmd_increment_address); --n; } }
+			else if (cmd == 'D') { unsigned int n; if (read_value(&n)) while (n--) { icsp_cmd(icsp_cmd_read_data); write_value(icsp_read()); icsp_cmd(icsp_cmd_increment_address); } }
+			else if (cmd == 'K') checksum();
+			else if (cmd == 'F') set_clock();
 			else if (cmd == 'I') icsp_cmd(icsp_cmd_increment_address);
+			else if (cmd == 'J') { unsigned int n; if (read_value(&n)) while (n--) icsp_cmd(icsp_cmd_increment_address); }
 			else if (cmd == 'A') icsp_cmd(icsp_cmd_reset_address);
 			else if (cmd == 'P') icsp_cmd(icsp_cmd_begin_programming);
 			else if (cmd == 'Q') icsp_cmd(icsp_cmd_begin_externally_timed_programming);
 			else if (cmd == 'S') icsp_cmd(icsp_cmd_end_externally_timed_programming);
 			else if (cmd == 'X') icsp_cmd(icsp_cmd_bulk_erase);
 			else if (cmd == 'Y') icsp_cmd(icsp_cmd_row_erase);
+			else if (cmd == 'p') timed_cmd(icsp_cmd_begin_programming);
+			else if (cmd == 'x') timed_cmd(icsp_cmd_bulk_erase);
+			else if (cmd == 'y') timed_cmd(icsp_cmd_row_erase);
 		}
 	}
 
@@ -142,6 +329,7 @@ BOOL USER_USB_CALLBACK_EVENT_HANDLER(int event, void *, WORD) {
 	switch (event) {
 		case EVENT_CONFIGURED:
 			CDCInitEP();
+			io_reset();
 			break;
 		case EVENT_EP0_REQUEST:
 			USBCheckCDCRequest();
@@ -2,7 +2,7 @@
 #define USB_MAX_NUM_INT 2
 #define USB_MAX_EP_NUMBER 2
 #define USB_PING_PONG_MODE USB_PING_PONG__FULL_PING_PONG
-#define USB_POLLING
+#define USB_INTERRUPT
 #define USB_PULLUP_OPTION USB_PULLUP_ENABLE
 #define USB_TRANSCEIVER_OPTION USB_INTERNAL_TRANSCEIVER
 #define USB_SPEED_OPTION USB_FULL_SPEED
@@ -17,5 +17,5 @@
 
 #define CDC_DATA_INTF_ID      1
 #define CDC_DATA_EP           2
-#define CDC_DATA_OUT_EP_SIZE  1
-#define CDC_DATA_IN_EP_SIZE   1
+#define CDC_DATA_OUT_EP_SIZE  64
+#define CDC_DATA_IN_EP_SIZE   64